@@ -15,7 +15,15 @@
 //! [Parser]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Parser.html
 //! [tree-sitter]: https://tree-sitter.github.io/
 
-use tree_sitter::Language;
+use std::{
+    cell::{Cell, RefCell},
+    mem,
+    panic::{self, AssertUnwindSafe},
+    sync::{mpsc, Arc, Mutex, OnceLock},
+    thread,
+};
+
+use tree_sitter::{Language, Parser, Tree};
 
 extern "C" {
     fn tree_sitter_practice() -> Language;
@@ -28,6 +36,212 @@ pub fn language() -> Language {
     unsafe { tree_sitter_practice() }
 }
 
+/// The generated parser, including its parse tables.
+const PARSER_C: &[u8] = include_bytes!("../../src/parser.c");
+
+/// A hash of this grammar's ABI version, node kinds, field names and generated parser.
+///
+/// It changes whenever `src/parser.c` is regenerated with different content, including changes
+/// that only affect the parse tables such as precedence or associativity. It can be used to
+/// invalidate anything derived from this grammar's parse trees.
+pub fn grammar_hash() -> u64 {
+    hash_grammar(language(), PARSER_C)
+}
+
+fn hash_grammar(language: Language, parser_c: &[u8]) -> u64 {
+    let mut hash = Fnv1a::default();
+
+    hash.write(&(language.version() as u64).to_le_bytes());
+    for id in 0..language.node_kind_count() as u16 {
+        hash.write(language.node_kind_for_id(id).unwrap_or("").as_bytes());
+        hash.write(&[language.node_kind_is_named(id) as u8, 0]);
+    }
+    for id in 1..=language.field_count() as u16 {
+        hash.write(language.field_name_for_id(id).unwrap_or("").as_bytes());
+        hash.write(&[0]);
+    }
+    hash.write(parser_c);
+
+    hash.0
+}
+
+struct Fnv1a(u64);
+
+impl Default for Fnv1a {
+    fn default() -> Self {
+        Fnv1a(0xcbf29ce484222325)
+    }
+}
+
+impl Fnv1a {
+    fn write(&mut self, bytes: &[u8]) {
+        for &b in bytes {
+            self.0 = (self.0 ^ b as u64).wrapping_mul(0x100000001b3);
+        }
+    }
+}
+
+thread_local! {
+    static PARSER: RefCell<Option<Parser>> = RefCell::new(None);
+}
+
+fn new_parser() -> Parser {
+    let mut parser = Parser::new();
+    parser
+        .set_language(language())
+        .expect("Error loading practice grammar");
+    parser
+}
+
+/// Run `f` with this thread's cached [Parser][] for this grammar, creating it on first use.
+///
+/// The parser's timeout is cleared after `f` returns. A nested call from inside `f` gets a
+/// fresh parser.
+///
+/// [Parser]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Parser.html
+pub fn with_parser<R>(f: impl FnOnce(&mut Parser) -> R) -> R {
+    PARSER.with(|cached| match cached.try_borrow_mut() {
+        Ok(mut cached) => {
+            let parser = cached.get_or_insert_with(new_parser);
+            let result = f(parser);
+            parser.set_timeout_micros(0);
+            result
+        }
+        Err(_) => f(&mut new_parser()),
+    })
+}
+
+/// Parse `source` with this thread's cached parser, reusing `old_tree` if it is given.
+///
+/// As with [Parser::parse][], `old_tree` must already have been edited to match `source`.
+///
+/// [Parser::parse]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Parser.html#method.parse
+pub fn parse(source: &str, old_tree: Option<&Tree>) -> Option<Tree> {
+    with_parser(|parser| parser.parse(source, old_tree))
+}
+
+/// A task sent to the pool. See [run_many][] for why borrowed tasks can be `'static` here.
+///
+/// [run_many]: fn.run_many.html
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+/// Worker threads that live for the rest of the process, one per core.
+///
+/// Each worker parses with its own cached parser (see [with_parser][]), so the parser is created
+/// and its language set once per worker rather than once per batch.
+///
+/// [with_parser]: fn.with_parser.html
+struct Pool {
+    jobs: mpsc::Sender<Job>,
+    threads: usize,
+}
+
+thread_local! {
+    static IN_POOL: Cell<bool> = Cell::new(false);
+}
+
+fn pool() -> &'static Pool {
+    static POOL: OnceLock<Pool> = OnceLock::new();
+
+    POOL.get_or_init(|| {
+        let threads = thread::available_parallelism().map_or(1, |n| n.get());
+        let (jobs, receiver) = mpsc::channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+
+        for _ in 0..threads {
+            let receiver = receiver.clone();
+            thread::spawn(move || {
+                IN_POOL.with(|in_pool| in_pool.set(true));
+                loop {
+                    // Each worker takes the next task, so long inputs do not hold up the others.
+                    let job = match receiver.lock().unwrap().recv() {
+                        Ok(job) => job,
+                        Err(_) => break,
+                    };
+                    job();
+                }
+            });
+        }
+
+        Pool { jobs, threads }
+    })
+}
+
+/// Run every task on the shared pool of worker threads and return the results in input order.
+///
+/// The tasks may borrow from the caller: this function does not return until every task has
+/// finished, so nothing is copied to hand the tasks to the pool. A task runs on a worker whose
+/// [with_parser][] keeps its parser between calls. If a task panics, the panic is resumed here
+/// after the other tasks have finished. Called from inside a task, the tasks run on the calling
+/// thread instead, so that a busy pool cannot wait on itself.
+///
+/// [with_parser]: fn.with_parser.html
+pub fn run_many<'a, T, F>(tasks: Vec<F>) -> Vec<T>
+where
+    T: Send + 'static,
+    F: FnOnce() -> T + Send + 'a,
+{
+    if tasks.len() <= 1 || pool().threads <= 1 || IN_POOL.with(|in_pool| in_pool.get()) {
+        return tasks.into_iter().map(|task| task()).collect();
+    }
+
+    let count = tasks.len();
+    let (reply, done) = mpsc::channel();
+    for (index, task) in tasks.into_iter().enumerate() {
+        let reply = reply.clone();
+        let job: Box<dyn FnOnce() + Send + 'a> = Box::new(move || {
+            let result = panic::catch_unwind(AssertUnwindSafe(task));
+            let _ = reply.send((index, result));
+        });
+        // SAFETY: the loop below waits until every job has sent its reply, and a job drops its
+        // task (and with it everything it borrows) before sending, so no job outlives `'a`.
+        // Jobs catch panics, and sending to the pool cannot fail, so every job does reply.
+        let job = unsafe { mem::transmute::<Box<dyn FnOnce() + Send + 'a>, Job>(job) };
+        pool().jobs.send(job).expect("Parser pool has stopped");
+    }
+    drop(reply);
+
+    let mut results = (0..count).map(|_| None).collect::<Vec<_>>();
+    for _ in 0..count {
+        let (index, result) = done.recv().expect("Parser pool has stopped");
+        results[index] = Some(result);
+    }
+
+    results
+        .into_iter()
+        .map(|result| match result.unwrap() {
+            Ok(value) => value,
+            Err(payload) => panic::resume_unwind(payload),
+        })
+        .collect()
+}
+
+/// Parse every source on a shared pool of worker threads and return the trees in input order.
+pub fn parse_many(sources: &[&str]) -> Vec<Option<Tree>> {
+    reparse_many(sources, &[])
+}
+
+/// Like [parse_many][], but reuse `old_trees[i]` when parsing `sources[i]`.
+///
+/// `old_trees` may be shorter than `sources`; the remaining sources are parsed from scratch.
+/// The pool's threads borrow the sources (see [run_many][]), and the old trees are shared with
+/// them by cloning, which only bumps a reference count.
+///
+/// [parse_many]: fn.parse_many.html
+/// [run_many]: fn.run_many.html
+pub fn reparse_many(sources: &[&str], old_trees: &[Option<&Tree>]) -> Vec<Option<Tree>> {
+    let tasks = sources
+        .iter()
+        .enumerate()
+        .map(|(i, &source)| {
+            let old_tree = old_trees.get(i).copied().flatten().cloned();
+            move || parse(source, old_tree.as_ref())
+        })
+        .collect();
+
+    run_many(tasks)
+}
+
 /// The content of the [`node-types.json`][] file for this grammar.
 ///
 /// [`node-types.json`]: https://tree-sitter.github.io/tree-sitter/using-parsers#static-node-types
@@ -49,4 +263,58 @@ mod tests {
             .set_language(super::language())
             .expect("Error loading practice language");
     }
+
+    #[test]
+    fn test_grammar_hash() {
+        assert_eq!(super::grammar_hash(), super::grammar_hash());
+        assert_ne!(super::grammar_hash(), 0xcbf29ce484222325);
+
+        // A regenerated parser with the same symbols but different parse tables gets another hash.
+        let language = super::language();
+        let parser_c = String::from_utf8(super::PARSER_C.to_vec()).unwrap();
+        let regenerated = parser_c.replacen("SHIFT(2),", "SHIFT(3),", 1);
+        assert_ne!(regenerated, parser_c);
+        assert_ne!(
+            super::hash_grammar(language, regenerated.as_bytes()),
+            super::grammar_hash()
+        );
+    }
+
+    #[test]
+    fn test_parse_many() {
+        let sources = (0..100).map(|i| "1+".repeat(i) + "1").collect::<Vec<_>>();
+        let sources = sources.iter().map(|s| s.as_str()).collect::<Vec<_>>();
+
+        let trees = super::parse_many(&sources);
+        assert_eq!(trees.len(), sources.len());
+        for (source, tree) in sources.iter().zip(&trees) {
+            assert_eq!(tree.as_ref().unwrap().root_node().end_byte(), source.len());
+        }
+
+        let old_trees = trees.iter().map(|tree| tree.as_ref()).collect::<Vec<_>>();
+        let trees = super::reparse_many(&sources, &old_trees);
+        for (source, tree) in sources.iter().zip(&trees) {
+            assert_eq!(tree.as_ref().unwrap().root_node().end_byte(), source.len());
+        }
+    }
+
+    #[test]
+    fn test_run_many() {
+        let words = (0..100).map(|i| i.to_string()).collect::<Vec<_>>();
+        let tasks = words.iter().map(|word| move || word.len()).collect();
+        let lengths = super::run_many(tasks);
+        assert_eq!(lengths, words.iter().map(|w| w.len()).collect::<Vec<_>>());
+
+        // Tasks that start more tasks run them on their own thread instead of waiting on the pool.
+        let tasks = (0..8)
+            .map(|i| move || super::run_many((0..8).map(|j| move || i * j).collect::<Vec<_>>()))
+            .collect();
+        let products = super::run_many(tasks);
+        assert_eq!(products[3], (0..8).map(|j| 3 * j).collect::<Vec<_>>());
+
+        let panicked = std::panic::catch_unwind(|| {
+            super::run_many((0..8).map(|i| move || assert_ne!(i, 5)).collect::<Vec<_>>())
+        });
+        assert!(panicked.is_err());
+    }
 }
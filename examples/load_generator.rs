@@ -0,0 +1,94 @@
+//! 評価サーバーに負荷をかけ、レイテンシとスループットを測る
+//!
+//! ```sh
+//! cargo run --release -- --server 127.0.0.1:7879 &
+//! cargo run --release --example load_generator -- 127.0.0.1:7879 8 100000 32
+//! ```
+//!
+//! 引数は順にアドレス、接続数、接続あたりのリクエスト数、パイプラインの深さ。
+
+use std::{
+    env,
+    io::{BufRead, BufReader, BufWriter, Write},
+    net::TcpStream,
+    thread,
+    time::{Duration, Instant},
+};
+
+fn arg<T: std::str::FromStr>(index: usize, default: T) -> T {
+    env::args()
+        .nth(index)
+        .and_then(|arg| arg.parse().ok())
+        .unwrap_or(default)
+}
+
+/// 1 接続ぶんの負荷をかけ、各リクエストのレイテンシを返す
+fn run_connection(addr: &str, session: usize, requests: usize, depth: usize) -> Vec<Duration> {
+    let stream = TcpStream::connect(addr).expect("Cannot connect");
+    stream.set_nodelay(true).unwrap();
+    let mut reader = BufReader::new(stream.try_clone().unwrap());
+    let mut writer = BufWriter::new(stream);
+
+    let mut line = String::new();
+    writeln!(writer, "s{} x={}", session, session).unwrap();
+    writer.flush().unwrap();
+    reader.read_line(&mut line).unwrap();
+
+    let mut latencies = Vec::with_capacity(requests);
+    let mut sent = 0;
+    while sent < requests {
+        let batch = depth.min(requests - sent);
+        let start = Instant::now();
+        for i in 0..batch {
+            writeln!(writer, "s{} x*{}+(x-1)/2", session, sent + i).unwrap();
+        }
+        writer.flush().unwrap();
+
+        for _ in 0..batch {
+            line.clear();
+            reader.read_line(&mut line).unwrap();
+            assert!(line.starts_with("ok "), "unexpected response: {}", line);
+            latencies.push(start.elapsed());
+        }
+        sent += batch;
+    }
+
+    latencies
+}
+
+fn main() {
+    let addr = arg(1, "127.0.0.1:7879".to_owned());
+    let connections = arg(2, 4);
+    let requests = arg(3, 10000);
+    let depth = arg(4, 16usize).max(1);
+
+    let start = Instant::now();
+    let handles = (0..connections)
+        .map(|session| {
+            let addr = addr.clone();
+            thread::spawn(move || run_connection(&addr, session, requests, depth))
+        })
+        .collect::<Vec<_>>();
+
+    let mut latencies = handles
+        .into_iter()
+        .flat_map(|h| h.join().unwrap())
+        .collect::<Vec<_>>();
+    let elapsed = start.elapsed();
+
+    latencies.sort();
+    let percentile = |p: f64| latencies[((latencies.len() - 1) as f64 * p) as usize];
+
+    println!(
+        "{} requests in {:.3?} ({:.0} req/s)",
+        latencies.len(),
+        elapsed,
+        latencies.len() as f64 / elapsed.as_secs_f64()
+    );
+    println!(
+        "latency p50={:?} p99={:?} max={:?}",
+        percentile(0.5),
+        percentile(0.99),
+        latencies.last().unwrap()
+    );
+}
@@ -0,0 +1,365 @@
+//! 複数スレッドから読み、1 つずつ書き込める変数の保存先
+//!
+//! 変数の集合は不変な版 (`PracticeContext`) として公開する。読み手はロックを取らずに現在の版を読み、
+//! 書き手は現在の版を複製して書き換え、ポインタの差し替えで新しい版を公開する。
+//!
+//! 古い版の解放はエポックで管理する。読み手は読み始めたときのエポックを自分のスロットに記録し、
+//! 書き手は版を差し替えるたびにエポックを進める。差し替えたときのエポックより前から読んでいる読み手が
+//! いなくなった版だけを解放する。
+
+use std::{
+    ops::Deref,
+    sync::{
+        atomic::{AtomicPtr, AtomicU64, Ordering},
+        Arc, Mutex,
+    },
+};
+
+use anyhow::Result;
+use tree_sitter::Parser;
+
+use crate::{eval_expr, eval_node, limits::Budget, number::Number, statement, PracticeContext};
+
+struct Shared {
+    current: AtomicPtr<PracticeContext>,
+    epoch: AtomicU64,
+    /// 各読み手が読み始めたときのエポック。読んでいなければ 0
+    slots: Mutex<Vec<Arc<AtomicU64>>>,
+    /// 差し替えられた版と、差し替えたときのエポック。書き込みの直列化も兼ねる
+    retired: Mutex<Vec<(u64, *mut PracticeContext)>>,
+}
+
+// 版は公開した後は変更せず、解放は上記の手順で読み手がいないことを確かめてから行う
+unsafe impl Send for Shared {}
+unsafe impl Sync for Shared {}
+
+impl Shared {
+    fn reclaim(&self, retired: &mut Vec<(u64, *mut PracticeContext)>) {
+        let oldest = self
+            .slots
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|slot| slot.load(Ordering::SeqCst))
+            .filter(|&epoch| epoch != 0)
+            .min()
+            .unwrap_or(u64::MAX);
+
+        retired.retain(|&(epoch, version)| {
+            if epoch <= oldest {
+                drop(unsafe { Box::from_raw(version) });
+                false
+            } else {
+                true
+            }
+        });
+    }
+}
+
+impl Drop for Shared {
+    fn drop(&mut self) {
+        // 読み手は `Shared` を参照しているので、ここに来たときには誰も読んでいない
+        drop(unsafe { Box::from_raw(*self.current.get_mut()) });
+        for (_, version) in self.retired.get_mut().unwrap().drain(..) {
+            drop(unsafe { Box::from_raw(version) });
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct SharedContext {
+    shared: Arc<Shared>,
+}
+
+impl SharedContext {
+    pub fn new(ctx: PracticeContext) -> SharedContext {
+        SharedContext {
+            shared: Arc::new(Shared {
+                current: AtomicPtr::new(Box::into_raw(Box::new(ctx))),
+                epoch: AtomicU64::new(1),
+                slots: Mutex::default(),
+                retired: Mutex::default(),
+            }),
+        }
+    }
+
+    /// 読み手を登録する。読み手はスレッドごとに 1 つ作る
+    pub fn reader(&self) -> Reader {
+        let slot = Arc::new(AtomicU64::new(0));
+        self.shared.slots.lock().unwrap().push(slot.clone());
+
+        Reader {
+            shared: self.shared.clone(),
+            slot,
+        }
+    }
+
+    /// 現在の版を複製して `f` で書き換え、`f` が成功したら新しい版として公開する
+    pub fn update<R>(&self, f: impl FnOnce(&mut PracticeContext) -> Result<R>) -> Result<R> {
+        let mut retired = self.shared.retired.lock().unwrap();
+
+        // 書き手はロックで直列化されているので、現在の版が解放されることはない
+        let mut next = unsafe { &*self.shared.current.load(Ordering::SeqCst) }.clone();
+        let result = f(&mut next)?;
+
+        let old = self
+            .shared
+            .current
+            .swap(Box::into_raw(Box::new(next)), Ordering::SeqCst);
+        let epoch = self.shared.epoch.fetch_add(1, Ordering::SeqCst) + 1;
+        retired.push((epoch, old));
+        self.shared.reclaim(&mut retired);
+
+        Ok(result)
+    }
+}
+
+pub struct Reader {
+    shared: Arc<Shared>,
+    slot: Arc<AtomicU64>,
+}
+
+impl Reader {
+    /// この読み手が読んでいる変数の保存先
+    pub fn context(&self) -> SharedContext {
+        SharedContext {
+            shared: self.shared.clone(),
+        }
+    }
+
+    /// `shared` の読み手かどうか
+    pub fn reads(&self, shared: &SharedContext) -> bool {
+        Arc::ptr_eq(&self.shared, &shared.shared)
+    }
+
+    /// 現在の版を取得する。`Guard` を持っている間は同じ版が見え続ける
+    pub fn pin(&mut self) -> Guard<'_> {
+        let epoch = self.shared.epoch.load(Ordering::SeqCst);
+        self.slot.store(epoch, Ordering::SeqCst);
+        let ctx = self.shared.current.load(Ordering::SeqCst);
+
+        Guard {
+            slot: &self.slot,
+            ctx: unsafe { &*ctx },
+        }
+    }
+}
+
+impl Drop for Reader {
+    fn drop(&mut self) {
+        self.shared
+            .slots
+            .lock()
+            .unwrap()
+            .retain(|slot| !Arc::ptr_eq(slot, &self.slot));
+    }
+}
+
+pub(crate) struct Guard<'a> {
+    slot: &'a AtomicU64,
+    ctx: &'a PracticeContext,
+}
+
+impl Deref for Guard<'_> {
+    type Target = PracticeContext;
+
+    fn deref(&self) -> &PracticeContext {
+        self.ctx
+    }
+}
+
+impl Drop for Guard<'_> {
+    fn drop(&mut self) {
+        self.slot.store(0, Ordering::SeqCst);
+    }
+}
+
+/// 代入は `reader` が読んでいる保存先に新しい版として公開し、それ以外の式はロックを取らずに現在の版で評価する
+pub fn eval_shared<N: Number>(
+    parser: &mut Parser,
+    source: &str,
+    reader: &mut Reader,
+    budget: &Budget,
+) -> Result<N> {
+    let tree = budget.parse(parser, source)?;
+    let root_node = tree.root_node();
+
+    let statement = statement(root_node)?;
+
+    if statement.kind() == "assignment" {
+        reader
+            .context()
+            .update(|ctx| eval_node(statement, source, ctx, budget))
+    } else {
+        eval_expr(statement, source, &reader.pin(), budget)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        sync::{
+            atomic::{AtomicBool, Ordering},
+            Arc, Mutex,
+        },
+        thread,
+        time::{Duration, Instant},
+    };
+
+    use anyhow::Result;
+
+    use super::SharedContext;
+    use crate::{number::Value, PracticeContext};
+
+    fn assign(ctx: &mut PracticeContext, name: &str, value: f64) -> Result<()> {
+        ctx.variables.insert(name, Value::Float(value));
+        Ok(())
+    }
+
+    #[test]
+    fn test_versions() {
+        let shared = SharedContext::new(PracticeContext::default());
+        let mut reader = shared.reader();
+
+        shared.update(|ctx| assign(ctx, "x", 1.0)).unwrap();
+        let guard = reader.pin();
+        shared.update(|ctx| assign(ctx, "x", 2.0)).unwrap();
+        assert!(shared
+            .update(|_| -> Result<()> { anyhow::bail!("failed") })
+            .is_err());
+
+        // 読み始めた版は、後から書き込まれても変わらない
+        assert_eq!(guard.get("x"), Some(Value::Float(1.0)));
+        drop(guard);
+        assert_eq!(reader.pin().get("x"), Some(Value::Float(2.0)));
+        assert_eq!(shared.shared.retired.lock().unwrap().len(), 1);
+
+        shared.update(|ctx| assign(ctx, "y", 3.0)).unwrap();
+        assert_eq!(shared.shared.retired.lock().unwrap().len(), 0);
+    }
+
+    /// 読み手のスレッド数ごとのスループットを、`Mutex` で守った場合と比べる
+    ///
+    /// `cargo test --release -- --ignored --nocapture bench_readers`
+    #[test]
+    #[ignore]
+    fn bench_readers() {
+        let mut ctx = PracticeContext::default();
+        for i in 0..1000 {
+            ctx.variables.insert(&format!("v{}", i), Value::Int(i));
+        }
+        let duration = Duration::from_millis(500);
+        let cores = thread::available_parallelism().map_or(1, |n| n.get());
+
+        let mut threads = 1;
+        while threads <= cores {
+            let shared = SharedContext::new(ctx.clone());
+            let reads = run(threads, duration, &shared, |shared| {
+                let mut reader = shared.reader();
+                move |shared: &SharedContext, i: usize| {
+                    if i % 10000 == 0 {
+                        shared.update(|ctx| assign(ctx, "v0", i as f64)).unwrap();
+                    }
+                    reader.pin().get("v1").unwrap().to_f64()
+                }
+            });
+
+            let locked = Arc::new(Mutex::new(ctx.clone()));
+            let locked_reads = run(threads, duration, &locked, |_| {
+                |locked: &Arc<Mutex<PracticeContext>>, i: usize| {
+                    if i % 10000 == 0 {
+                        assign(&mut locked.lock().unwrap(), "v0", i as f64).unwrap();
+                    }
+                    locked.lock().unwrap().get("v1").unwrap().to_f64()
+                }
+            });
+
+            println!(
+                "{:>3} threads: versioned {:>12.0} reads/s, mutex {:>12.0} reads/s",
+                threads,
+                reads as f64 / duration.as_secs_f64(),
+                locked_reads as f64 / duration.as_secs_f64()
+            );
+            threads *= 2;
+        }
+    }
+
+    /// 書き込みばかりのときの 1 回の `update` の時間を、変数の数ごとに `Mutex` で守った場合と比べる
+    ///
+    /// `cargo test --release -- --ignored --nocapture bench_writes`
+    #[test]
+    #[ignore]
+    fn bench_writes() {
+        let writes = 10000;
+
+        for n in [1000, 10000, 100000] {
+            let mut ctx = PracticeContext::default();
+            for i in 0..n {
+                ctx.variables.insert(&format!("v{}", i), Value::Int(i));
+            }
+
+            let shared = SharedContext::new(ctx.clone());
+            let start = Instant::now();
+            for i in 0..writes {
+                shared
+                    .update(|ctx| assign(ctx, &format!("v{}", i % n), i as f64))
+                    .unwrap();
+            }
+            let versioned = start.elapsed() / writes as u32;
+
+            let locked = Mutex::new(ctx);
+            let start = Instant::now();
+            for i in 0..writes {
+                assign(
+                    &mut locked.lock().unwrap(),
+                    &format!("v{}", i % n),
+                    i as f64,
+                )
+                .unwrap();
+            }
+            let mutex = start.elapsed() / writes as u32;
+
+            println!(
+                "{:>6} variables: versioned {:>10?}/write, mutex {:>10?}/write",
+                n, versioned, mutex
+            );
+        }
+    }
+
+    /// `threads` 個のスレッドで `duration` の間 `read` を呼び続け、合計の回数を返す
+    fn run<S, F>(
+        threads: usize,
+        duration: Duration,
+        state: &S,
+        make_read: impl Fn(&S) -> F + Sync,
+    ) -> usize
+    where
+        S: Sync,
+        F: FnMut(&S, usize) -> f64,
+    {
+        let stop = AtomicBool::new(false);
+        thread::scope(|s| {
+            let handles = (0..threads)
+                .map(|_| {
+                    s.spawn(|| {
+                        let mut read = make_read(state);
+                        let mut count = 0;
+                        while !stop.load(Ordering::Relaxed) {
+                            std::hint::black_box(read(state, count));
+                            count += 1;
+                        }
+                        count
+                    })
+                })
+                .collect::<Vec<_>>();
+
+            let start = Instant::now();
+            while start.elapsed() < duration {
+                thread::sleep(Duration::from_millis(10));
+            }
+            stop.store(true, Ordering::Relaxed);
+
+            handles.into_iter().map(|h| h.join().unwrap()).sum()
+        })
+    }
+}
@@ -0,0 +1,143 @@
+//! 1 リクエストあたりのパース時間と評価ステップ数の上限
+//!
+//! 不正な入力 (`2+` の変種、閉じない `((((`、閉じない `{` コメントなど) ではパーサーのエラー回復が重くなるので、
+//! パースにはタイムアウトを、評価にはステップ数の上限を設ける。
+//! 構文エラーを含む木は評価せずに、その場でエラーにする。
+
+use std::{
+    fmt,
+    sync::atomic::{AtomicI64, AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use anyhow::{bail, Result};
+use tree_sitter::{Parser, Tree};
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Limits {
+    /// `None` か 0 なら無制限
+    pub parse_timeout: Option<Duration>,
+    pub max_steps: Option<u64>,
+}
+
+/// `Budget::cancel` で中断されたことを表すエラー
+#[derive(Debug)]
+pub struct Cancelled;
+
+impl fmt::Display for Cancelled {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "cancelled")
+    }
+}
+
+impl std::error::Error for Cancelled {}
+
+/// 構文エラーを含む入力であることを表すエラー。タイムアウトと違い、同じ入力なら必ず同じ結果になる
+#[derive(Debug)]
+pub struct SyntaxError;
+
+impl fmt::Display for SyntaxError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "syntax error")
+    }
+}
+
+impl std::error::Error for SyntaxError {}
+
+/// 1 リクエストの予算。別スレッドから `cancel` すると、パースも評価も中断する
+pub struct Budget {
+    parse_timeout: Option<Duration>,
+    steps: AtomicI64,
+    cancelled: AtomicUsize,
+}
+
+impl Budget {
+    pub fn new(limits: &Limits) -> Budget {
+        Budget {
+            parse_timeout: limits.parse_timeout.filter(|t| !t.is_zero()),
+            steps: AtomicI64::new(
+                limits
+                    .max_steps
+                    .map_or(i64::MAX, |steps| steps.min(i64::MAX as u64) as i64),
+            ),
+            cancelled: AtomicUsize::new(0),
+        }
+    }
+
+    pub fn cancel(&self) {
+        self.cancelled.store(1, Ordering::Relaxed);
+    }
+
+    /// 評価の 1 ステップ (ノード 1 つ) ぶん予算を消費する
+    pub fn step(&self) -> Result<()> {
+        if self.cancelled.load(Ordering::Relaxed) != 0 {
+            return Err(Cancelled.into());
+        }
+        if self.steps.fetch_sub(1, Ordering::Relaxed) <= 0 {
+            bail!("evaluation step limit exceeded");
+        }
+
+        Ok(())
+    }
+
+    /// タイムアウトとキャンセルを効かせてパースする。構文エラーを含む場合はエラーにする
+    pub fn parse(&self, parser: &mut Parser, source: &str) -> Result<Tree> {
+        let timeout = self
+            .parse_timeout
+            .map_or(0, |t| t.as_micros().max(1) as u64);
+        parser.set_timeout_micros(timeout);
+
+        // フラグはパースが終わるまで生きている `self` が持つ
+        unsafe { parser.set_cancellation_flag(Some(&self.cancelled)) };
+        let tree = parser.parse(source, None);
+        unsafe { parser.set_cancellation_flag(None) };
+
+        let tree = match tree {
+            Some(tree) => tree,
+            None => {
+                // 中断したパースの続きから再開しないように、状態を捨てておく
+                parser.reset();
+                if self.cancelled.load(Ordering::Relaxed) != 0 {
+                    return Err(Cancelled.into());
+                }
+                bail!("parse timed out");
+            }
+        };
+
+        if tree.root_node().has_error() {
+            return Err(SyntaxError.into());
+        }
+
+        Ok(tree)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{Budget, Cancelled, Limits};
+
+    #[test]
+    fn test_budget() {
+        let budget = Budget::new(&Limits {
+            parse_timeout: None,
+            max_steps: Some(2),
+        });
+        assert!(budget.step().is_ok());
+        assert!(budget.step().is_ok());
+        assert!(budget.step().is_err());
+
+        let budget = Budget::new(&Limits::default());
+        assert!(budget.step().is_ok());
+        budget.cancel();
+        assert!(budget.step().unwrap_err().is::<Cancelled>());
+
+        // タイムアウト 0 は無制限
+        let budget = Budget::new(&Limits {
+            parse_timeout: Some(Duration::ZERO),
+            max_steps: None,
+        });
+        assert_eq!(budget.parse_timeout, None);
+    }
+}
@@ -1,108 +1,344 @@
-use std::{collections::HashMap, io::stdin};
+mod concurrent;
+mod limits;
+mod mmap;
+mod number;
+mod parallel;
+mod script;
+mod server;
+mod snapshot;
+mod variables;
 
-use anyhow::{Context, Result};
-use tree_sitter::Node;
+use std::{env, fs, io::stdin, path::Path, sync::Arc, thread, time::Duration};
 
-#[derive(Default)]
+use anyhow::{bail, ensure, Context, Result};
+use limits::{Budget, Limits};
+use number::{Number, Value};
+use snapshot::Snapshot;
+use tree_sitter::{Node, Parser};
+use variables::Variables;
+
+#[derive(Default, Clone)]
 struct PracticeContext {
-    variables: HashMap<String, f64>,
+    variables: Variables,
+    /// 復元したスナップショット。代入された変数は `variables` が優先される
+    snapshot: Option<Arc<Snapshot>>,
 }
 
-fn eval_node(node: Node, source: &str, ctx: &mut PracticeContext) -> Result<f64> {
-    match node.kind() {
-        "source_file" => eval_node(node.child(0).unwrap(), source, ctx),
-        "unary_expression" => {
-            let op = node.child_by_field_name("op").unwrap();
-            let expr = node.child_by_field_name("expr").unwrap();
-            let expr = eval_node(expr, source, ctx)?;
-
-            match op.kind() {
-                "+" => Ok(expr),
-                "-" => Ok(-expr),
-                _ => unreachable!(),
-            }
-        }
-        "parentheses_expression" => {
-            let expr = node.child_by_field_name("expr").unwrap();
-            eval_node(expr, source, ctx)
-        }
-        "binary_expression" => {
-            let lhs = node.child_by_field_name("lhs").unwrap();
-            let lhs = eval_node(lhs, source, ctx)?;
+impl PracticeContext {
+    fn restore(path: &Path, verify: bool) -> Result<PracticeContext> {
+        Ok(PracticeContext {
+            variables: Variables::default(),
+            snapshot: Some(Arc::new(Snapshot::load(path, verify)?)),
+        })
+    }
 
-            let rhs = node.child_by_field_name("rhs").unwrap();
-            let rhs = eval_node(rhs, source, ctx)?;
+    fn save(&self, path: &Path) -> Result<()> {
+        let assigned = self.variables.iter();
+        let restored = self.snapshot.iter().flat_map(|snapshot| snapshot.iter());
 
-            let op = node.child_by_field_name("op").unwrap();
+        // 同じ名前は先に現れたもの (代入された値) が残る
+        Snapshot::save(path, assigned.chain(restored))
+    }
 
-            match op.kind() {
-                "+" => Ok(lhs + rhs),
-                "-" => Ok(lhs - rhs),
-                "*" => Ok(lhs * rhs),
-                "/" => Ok(lhs / rhs),
-                "**" => Ok(lhs.powf(rhs)),
-                _ => unimplemented!(),
-            }
+    fn get(&self, name: &str) -> Option<Value> {
+        match self.variables.get(name) {
+            Some(value) => Some(value),
+            None => self.snapshot.as_ref()?.get(name),
         }
+    }
+}
+
+fn eval_node<N: Number>(
+    node: Node,
+    source: &str,
+    ctx: &mut PracticeContext,
+    budget: &Budget,
+) -> Result<N> {
+    match node.kind() {
+        "source_file" => eval_node(statement(node)?, source, ctx, budget),
         "assignment" => {
             let lhs = node.child_by_field_name("lhs").unwrap();
-            let lhs = lhs.utf8_text(source.as_bytes()).unwrap().to_owned();
+            let lhs = lhs.utf8_text(source.as_bytes()).unwrap();
 
             let rhs = node.child_by_field_name("rhs").unwrap();
-            let rhs = eval_node(rhs, source, ctx)?;
+            let rhs = eval_expr::<N>(rhs, source, ctx, budget)?;
 
-            ctx.variables.insert(lhs, rhs);
+            ctx.variables.insert(lhs, rhs.to_value());
 
             Ok(rhs)
         }
-        "number" => {
-            let text = node.utf8_text(source.as_bytes()).unwrap();
-            text.parse::<f64>()
-                .with_context(|| format!("Cannot parse as f64: {}", text))
-        }
-        "identifier" => {
-            let text = node.utf8_text(source.as_bytes()).unwrap();
+        _ => eval_expr(node, source, ctx, budget),
+    }
+}
 
-            ctx.variables
-                .get(text)
-                .cloned()
-                .with_context(|| format!("undefined variable: {}", text))
-        }
-        _ => {
-            dbg!(node);
-            unreachable!()
+/// 根の子のうち、コメントではない最初のもの (文) を返す
+fn statement(root_node: Node) -> Result<Node> {
+    (0..root_node.child_count())
+        .filter_map(|i| root_node.child(i))
+        .find(|n| !n.is_extra())
+        .context("Cannot parse")
+}
+
+/// 式の木を後順にたどったときに現れる演算
+pub(crate) enum Op<'a> {
+    Number(&'a str),
+    Load(&'a str),
+    Neg,
+    Binary(&'static str),
+    /// 値を変えないノード (括弧と単項の `+`)
+    Step,
+}
+
+/// 式の木を後順にたどり、ノードごとに演算を 1 つ `f` に渡す
+///
+/// 再帰せずに明示的なスタックでたどるので、深く入れ子になった式でもスレッドのスタックを使い切らない。
+pub(crate) fn walk_expr<'a>(
+    node: Node,
+    source: &'a str,
+    mut f: impl FnMut(Op<'a>) -> Result<()>,
+) -> Result<()> {
+    // (ノード, 子をすでに積んだかどうか)
+    let mut stack = vec![(node, false)];
+
+    while let Some((node, expanded)) = stack.pop() {
+        match node.kind() {
+            "unary_expression" | "parentheses_expression" if !expanded => {
+                stack.push((node, true));
+                stack.push((node.child_by_field_name("expr").unwrap(), false));
+            }
+            "unary_expression" => match node.child_by_field_name("op").unwrap().kind() {
+                "+" => f(Op::Step)?,
+                "-" => f(Op::Neg)?,
+                _ => unreachable!(),
+            },
+            "parentheses_expression" => f(Op::Step)?,
+            "binary_expression" if !expanded => {
+                stack.push((node, true));
+                stack.push((node.child_by_field_name("rhs").unwrap(), false));
+                stack.push((node.child_by_field_name("lhs").unwrap(), false));
+            }
+            "binary_expression" => f(Op::Binary(node.child_by_field_name("op").unwrap().kind()))?,
+            "number" => f(Op::Number(node.utf8_text(source.as_bytes()).unwrap()))?,
+            "identifier" => f(Op::Load(node.utf8_text(source.as_bytes()).unwrap()))?,
+            kind => bail!("Unexpected node: {}", kind),
         }
     }
+
+    Ok(())
 }
 
+/// 式を評価する。式は変数を参照するだけなので、複数スレッドから同じ `ctx` を共有できる
+///
+/// ノード 1 つを評価するごとに `budget` を 1 ステップ消費する。
+fn eval_expr<N: Number>(
+    node: Node,
+    source: &str,
+    ctx: &PracticeContext,
+    budget: &Budget,
+) -> Result<N> {
+    let mut values: Vec<N> = vec![];
+
+    walk_expr(node, source, |op| {
+        budget.step()?;
+
+        let value = match op {
+            Op::Number(text) => N::parse(text)?,
+            Op::Load(name) => ctx
+                .get(name)
+                .map(N::from_value)
+                .with_context(|| format!("undefined variable: {}", name))?,
+            Op::Neg => -values.pop().unwrap(),
+            Op::Step => return Ok(()),
+            Op::Binary(op) => {
+                let rhs = values.pop().unwrap();
+                let lhs = values.pop().unwrap();
+                match op {
+                    "+" => lhs + rhs,
+                    "-" => lhs - rhs,
+                    "*" => lhs * rhs,
+                    "/" => lhs / rhs,
+                    "**" => lhs.pow(rhs),
+                    _ => unimplemented!(),
+                }
+            }
+        };
+        values.push(value);
+
+        Ok(())
+    })?;
+
+    Ok(values.pop().unwrap())
+}
+
+#[cfg(test)]
 fn eval(source: &str, ctx: &mut PracticeContext) -> Result<f64> {
+    eval_as(source, ctx)
+}
+
+/// 整数どうしの演算を `i64` のまま正確に行う評価
+#[cfg(test)]
+fn eval_exact(source: &str, ctx: &mut PracticeContext) -> Result<Value> {
+    eval_as(source, ctx)
+}
+
+#[cfg(test)]
+fn eval_as<N: Number>(source: &str, ctx: &mut PracticeContext) -> Result<N> {
+    tree_sitter_practice::with_parser(|parser| {
+        eval_with(parser, source, ctx, &Budget::new(&Limits::default()))
+    })
+}
+
+fn new_parser() -> Result<Parser> {
     let language = tree_sitter_practice::language();
-    let mut parser = tree_sitter::Parser::new();
+    let mut parser = Parser::new();
     parser.set_language(language)?;
 
-    let tree = parser.parse(source, None).context("Cannot parse")?;
+    Ok(parser)
+}
+
+/// 作成済みの `parser` を使い回し、`budget` の範囲で評価する
+fn eval_with<N: Number>(
+    parser: &mut Parser,
+    source: &str,
+    ctx: &mut PracticeContext,
+    budget: &Budget,
+) -> Result<N> {
+    let tree = budget.parse(parser, source)?;
     let root_node = tree.root_node();
 
-    eval_node(root_node, source, ctx)
+    eval_node(root_node, source, ctx, budget)
 }
 
 fn main() -> Result<()> {
+    // --parse-timeout-ms <ms>, --max-steps <n>: 1 行あたりのパース時間と評価ステップ数の上限 (0 ms なら無制限)
+    let limits = Limits {
+        parse_timeout: arg_value("--parse-timeout-ms")
+            .map(|ms| ms.parse::<u64>().map(Duration::from_millis))
+            .transpose()
+            .context("--parse-timeout-ms must be a number")?,
+        max_steps: arg_value("--max-steps")
+            .map(|steps| steps.parse::<u64>())
+            .transpose()
+            .context("--max-steps must be a number")?,
+    };
+
+    // --server <addr>: 127.0.0.1:7879 や unix:/tmp/practice.sock で待ち受ける
+    if let Some(addr) = arg_value("--server") {
+        let workers = match arg_value("--workers") {
+            Some(workers) => workers
+                .parse::<usize>()
+                .context("--workers must be a number")?,
+            None => thread::available_parallelism().map_or(1, |n| n.get()),
+        };
+        return server::serve(&addr, workers, limits);
+    }
+
     let stdin = stdin();
 
     let mut source = String::new();
-    let mut ctx = PracticeContext::default();
+    // --restore <path>: 起動時にスナップショットから変数を復元する
+    // --verify: 復元するスナップショットのチェックサムも検査する (ファイル全体を読むので遅くなる)
+    let verify = env::args().any(|arg| arg == "--verify");
+    let mut ctx = match arg_value("--restore") {
+        Some(path) => PracticeContext::restore(Path::new(&path), verify)?,
+        None => PracticeContext::default(),
+    };
+
+    // --parallel: 長い式をトップレベルの `+`/`-` で分割して並列に評価する
+    let threads = if env::args().any(|arg| arg == "--parallel") {
+        thread::available_parallelism().map_or(1, |n| n.get())
+    } else {
+        1
+    };
 
-    while let Ok(_) = stdin.read_line(&mut source) {
-        println!("{}={}", source.trim(), eval(&source, &mut ctx)?);
-        source.clear();
+    // --exact: 整数どうしの演算を i64 で正確に行い、必要なときだけ f64 に昇格する
+    let exact = env::args().any(|arg| arg == "--exact");
+
+    let mut parser = new_parser()?;
+
+    // --script <path>: 標準入力の代わりにファイルの各行を評価する
+    // --cache-dir <dir>: コンパイルしたスクリプトを保存し、次回からパースを省く
+    if let Some(path) = arg_value("--script") {
+        let script = fs::read_to_string(&path).with_context(|| format!("Cannot read {}", path))?;
+        match arg_value("--cache-dir") {
+            Some(dir) => {
+                let program = script::load_or_compile(Path::new(&dir), &script, &limits)?;
+                let lines = script.lines().collect::<Vec<_>>();
+                ensure!(lines.len() == program.line_count(), "Stale script cache");
+                for (i, line) in lines.into_iter().enumerate() {
+                    let budget = Budget::new(&limits);
+                    let result = if exact {
+                        program.run::<Value>(i, &mut ctx, &budget)
+                    } else {
+                        program.run::<f64>(i, &mut ctx, &budget).map(Value::Float)
+                    };
+                    report(line, result);
+                }
+            }
+            None => {
+                for line in script.lines() {
+                    let budget = Budget::new(&limits);
+                    let result = if exact {
+                        eval_with::<Value>(&mut parser, line, &mut ctx, &budget)
+                    } else {
+                        eval_with::<f64>(&mut parser, line, &mut ctx, &budget).map(Value::Float)
+                    };
+                    report(line, result);
+                }
+            }
+        }
+    } else {
+        while stdin.read_line(&mut source)? > 0 {
+            let budget = Budget::new(&limits);
+            let result = if exact && threads > 1 {
+                parallel::eval_parallel::<Value>(&source, &mut ctx, threads, &budget)
+            } else if exact {
+                eval_with::<Value>(&mut parser, &source, &mut ctx, &budget)
+            } else if threads > 1 {
+                parallel::eval_parallel::<f64>(&source, &mut ctx, threads, &budget)
+                    .map(Value::Float)
+            } else {
+                eval_with::<f64>(&mut parser, &source, &mut ctx, &budget).map(Value::Float)
+            };
+            report(&source, result);
+            source.clear();
+        }
+    }
+
+    // --snapshot <path>: 入力を読み終えたら変数をスナップショットに保存する
+    if let Some(path) = arg_value("--snapshot") {
+        ctx.save(Path::new(&path))?;
     }
 
     Ok(())
 }
 
+/// エラーになった行は報告だけして、次の行に進む
+fn report(source: &str, result: Result<Value>) {
+    match result {
+        Ok(value) => println!("{}={}", source.trim(), value),
+        Err(e) => eprintln!("{}: {}", source.trim(), e),
+    }
+}
+
+fn arg_value(name: &str) -> Option<String> {
+    let mut args = env::args().skip_while(|arg| arg != name);
+    args.next()?;
+    args.next()
+}
+
 #[cfg(test)]
 mod tests {
-    use crate::{eval, PracticeContext};
+    use std::{
+        env, fs, process,
+        time::{Duration, Instant},
+    };
+
+    use crate::{
+        eval, eval_exact, eval_with,
+        limits::{Budget, Limits, SyntaxError},
+        new_parser, PracticeContext, Value,
+    };
 
     #[test]
     fn test_practice() {
@@ -117,5 +353,176 @@ mod tests {
         assert_eq!(eval("x=2**3+1", &mut ctx).unwrap(), 9.0);
         assert_eq!(eval("x*x", &mut ctx).unwrap(), 81.0);
         assert_eq!(eval("x{コメントテスト}*x", &mut ctx).unwrap(), 81.0);
+        assert_eq!(eval("{c}1", &mut ctx).unwrap(), 1.0);
+        assert_eq!(eval("{c} y=2", &mut ctx).unwrap(), 2.0);
+    }
+
+    #[test]
+    fn test_exact() {
+        let mut ctx = PracticeContext::default();
+        assert_eq!(
+            eval_exact("3**39+1", &mut ctx).unwrap(),
+            Value::Int(4052555153018976268)
+        );
+        assert_eq!(
+            eval_exact("2**64", &mut ctx).unwrap(),
+            Value::Float(2f64.powf(64.0))
+        );
+        assert_eq!(eval_exact("7*6/3", &mut ctx).unwrap(), Value::Int(14));
+        assert_eq!(eval_exact("1/2", &mut ctx).unwrap(), Value::Float(0.5));
+
+        assert_eq!(eval_exact("x=-2**3", &mut ctx).unwrap(), Value::Int(-8));
+        assert_eq!(eval_exact("x*x", &mut ctx).unwrap(), Value::Int(64));
+        assert_eq!(eval("x/16", &mut ctx).unwrap(), -0.5);
+
+        // 変数を経由しても整数の精度を落とさず、整数になった浮動小数点数も整数に戻さない
+        assert_eq!(
+            eval_exact("x=2**60", &mut ctx).unwrap(),
+            Value::Int(1 << 60)
+        );
+        assert_eq!(
+            eval_exact("x+1", &mut ctx).unwrap(),
+            Value::Int((1 << 60) + 1)
+        );
+        assert_eq!(
+            eval_exact("y=3**39", &mut ctx).unwrap(),
+            Value::Int(4052555153018976267)
+        );
+        assert_eq!(
+            eval_exact("y", &mut ctx).unwrap(),
+            Value::Int(4052555153018976267)
+        );
+        assert_eq!(eval_exact("z=1/2*4", &mut ctx).unwrap(), Value::Float(2.0));
+        assert_eq!(eval_exact("z", &mut ctx).unwrap(), Value::Float(2.0));
+    }
+
+    #[test]
+    fn test_deep_nesting() {
+        // 評価は再帰しないので、テストのスレッドのスタック (2 MiB) でも深い入れ子を評価できる
+        let depth = 100_000;
+        let mut ctx = PracticeContext::default();
+
+        let nested = format!("{}1{}", "(".repeat(depth), ")".repeat(depth));
+        assert_eq!(eval(&nested, &mut ctx).unwrap(), 1.0);
+
+        let chain = vec!["1"; depth].join("+");
+        assert_eq!(eval(&chain, &mut ctx).unwrap(), depth as f64);
+
+        let power = format!("x={}2", "1**".repeat(depth));
+        assert_eq!(eval(&power, &mut ctx).unwrap(), 1.0);
+
+        let negated = format!("{}x", "-".repeat(depth + 1));
+        assert_eq!(eval(&negated, &mut ctx).unwrap(), -1.0);
+    }
+
+    #[test]
+    fn test_limits() {
+        let mut parser = new_parser().unwrap();
+        let mut ctx = PracticeContext::default();
+        let mut eval = |source: &str, limits: Limits| {
+            eval_with::<f64>(&mut parser, source, &mut ctx, &Budget::new(&limits))
+        };
+
+        let limits = Limits {
+            parse_timeout: None,
+            max_steps: Some(3),
+        };
+        assert_eq!(eval("1+2", limits).unwrap(), 3.0);
+        assert!(eval("1+2*3", limits).is_err());
+
+        // 構文エラーは評価する前に弾く
+        assert!(eval("((((1", Limits::default()).is_err());
+        assert!(eval("1+{2", Limits::default()).is_err());
+        assert_eq!(eval("1+2", Limits::default()).unwrap(), 3.0);
+    }
+
+    /// エラー回復が重くなりやすい入力で、1 行あたりのレイテンシを本番と同じ `eval_with` の経路で測る
+    ///
+    /// `cargo test --release -- --ignored --nocapture bench_worst_case`
+    ///
+    /// タイムアウトを設定したときに p99 がタイムアウト付近で頭打ちになることを確認する。
+    #[test]
+    #[ignore]
+    fn bench_worst_case() {
+        let n = 10000;
+        let iterations = 100;
+        let inputs = [
+            ("valid", vec!["1"; n].join("+")),
+            ("trailing operators", "2+".repeat(n)),
+            ("unbalanced parens", format!("{}1", "(".repeat(n))),
+            ("unclosed comment", format!("1+{{{}", "2+".repeat(n))),
+            ("operator soup", "+-*/**(".repeat(n / 4)),
+            ("missing operands", "1 2 ".repeat(n / 2)),
+        ];
+
+        let mut parser = new_parser().unwrap();
+        for limits in [
+            Limits::default(),
+            Limits {
+                parse_timeout: Some(Duration::from_millis(5)),
+                max_steps: Some(10 * n as u64),
+            },
+        ] {
+            println!("{:?}", limits);
+            for (name, source) in &inputs {
+                let mut latencies = Vec::with_capacity(iterations);
+                let mut syntax_errors = 0;
+                let mut other_errors = 0;
+
+                for _ in 0..iterations {
+                    let mut ctx = PracticeContext::default();
+                    let start = Instant::now();
+                    let result =
+                        eval_with::<f64>(&mut parser, source, &mut ctx, &Budget::new(&limits));
+                    latencies.push(start.elapsed());
+                    match result {
+                        Err(e) if e.is::<SyntaxError>() => syntax_errors += 1,
+                        Err(_) => other_errors += 1,
+                        Ok(_) => {}
+                    }
+                }
+
+                latencies.sort();
+                let percentile = |p: f64| latencies[((latencies.len() - 1) as f64 * p) as usize];
+                println!(
+                    "{:<20} {:>8} bytes  p50={:<12?} p99={:<12?} max={:<12?} syntax errors={} other errors={}",
+                    name,
+                    source.len(),
+                    percentile(0.5),
+                    percentile(0.99),
+                    latencies.last().unwrap(),
+                    syntax_errors,
+                    other_errors,
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn test_restore() {
+        let path = env::temp_dir().join(format!("practice-restore-{}.bin", process::id()));
+
+        let mut ctx = PracticeContext::default();
+        eval("x=2", &mut ctx).unwrap();
+        eval("y=x*3", &mut ctx).unwrap();
+        ctx.save(&path).unwrap();
+
+        let mut ctx = PracticeContext::restore(&path, true).unwrap();
+        assert_eq!(eval("x+y", &mut ctx).unwrap(), 8.0);
+        assert_eq!(eval("x=10", &mut ctx).unwrap(), 10.0);
+        assert_eq!(eval("x+y", &mut ctx).unwrap(), 16.0);
+
+        // 復元後の代入はスナップショットに反映されず、保存し直すと反映される
+        assert_eq!(
+            PracticeContext::restore(&path, true).unwrap().get("x"),
+            Some(Value::Float(2.0))
+        );
+        ctx.save(&path).unwrap();
+        assert_eq!(
+            PracticeContext::restore(&path, true).unwrap().get("x"),
+            Some(Value::Float(10.0))
+        );
+
+        fs::remove_file(&path).unwrap();
     }
 }
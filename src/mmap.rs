@@ -0,0 +1,100 @@
+//! 読み取り専用のファイルマップと、保存するファイルの検査に使うハッシュ
+
+use std::{fs::File, io};
+
+/// FNV-1a (64 bit)
+pub fn fnv1a(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf29ce484222325, |hash, &b| {
+        (hash ^ b as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+pub fn read_u32(bytes: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes(bytes[at..at + 4].try_into().unwrap())
+}
+
+pub fn read_u64(bytes: &[u8], at: usize) -> u64 {
+    u64::from_le_bytes(bytes[at..at + 8].try_into().unwrap())
+}
+
+/// 読み取り専用のファイルマップ。Unix 以外ではファイル全体を読み込む
+#[cfg(unix)]
+pub struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+// マップは読み取り専用で、解放するまで変更されない
+#[cfg(unix)]
+unsafe impl Send for Mmap {}
+#[cfg(unix)]
+unsafe impl Sync for Mmap {}
+
+#[cfg(unix)]
+impl Mmap {
+    pub fn map(file: &File) -> io::Result<Mmap> {
+        use std::os::unix::io::AsRawFd;
+
+        let len = usize::try_from(file.metadata()?.len())
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+        if len == 0 {
+            // 長さ 0 の mmap はできないので、空のマップとして扱う
+            return Ok(Mmap {
+                ptr: std::ptr::null_mut(),
+                len,
+            });
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Mmap { ptr, len })
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe {
+                libc::munmap(self.ptr, self.len);
+            }
+        }
+    }
+}
+
+#[cfg(not(unix))]
+pub struct Mmap(Vec<u8>);
+
+#[cfg(not(unix))]
+impl Mmap {
+    pub fn map(file: &File) -> io::Result<Mmap> {
+        use std::io::Read;
+
+        let mut bytes = vec![];
+        (&*file).read_to_end(&mut bytes)?;
+        Ok(Mmap(bytes))
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        &self.0
+    }
+}
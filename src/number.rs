@@ -0,0 +1,195 @@
+//! 評価に使う数値の型
+//!
+//! 既定では従来どおりすべて `f64` で計算する。`Value` を使うと整数どうしの演算は `i64` のまま正確に行い、
+//! オーバーフローや割り切れない除算のときだけ `f64` に昇格する。
+//! 変数は `Value` のまま保持するので、変数を経由しても整数の精度は落ちない。
+
+use std::{
+    fmt,
+    ops::{Add, Div, Mul, Neg, Sub},
+};
+
+use anyhow::{Context, Result};
+
+pub trait Number:
+    Copy
+    + Send
+    + 'static
+    + Add<Output = Self>
+    + Sub<Output = Self>
+    + Mul<Output = Self>
+    + Div<Output = Self>
+    + Neg<Output = Self>
+{
+    fn parse(text: &str) -> Result<Self>;
+    fn pow(self, rhs: Self) -> Self;
+    /// 変数から読んだ値を変換する
+    fn from_value(value: Value) -> Self;
+    /// 変数に書き込む値に変換する
+    fn to_value(self) -> Value;
+}
+
+impl Number for f64 {
+    fn parse(text: &str) -> Result<Self> {
+        text.parse::<f64>()
+            .with_context(|| format!("Cannot parse as f64: {}", text))
+    }
+
+    fn pow(self, rhs: Self) -> Self {
+        self.powf(rhs)
+    }
+
+    fn from_value(value: Value) -> Self {
+        value.to_f64()
+    }
+
+    fn to_value(self) -> Value {
+        Value::Float(self)
+    }
+}
+
+/// `i64` で表せる間は整数のまま持ち、表せなくなったら `f64` に昇格する数値
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Value {
+    Int(i64),
+    Float(f64),
+}
+
+impl Value {
+    pub fn to_f64(self) -> f64 {
+        match self {
+            Value::Int(value) => value as f64,
+            Value::Float(value) => value,
+        }
+    }
+
+    /// 両辺が整数なら `int` を試し、失敗したら `f64` で計算し直す
+    fn apply(
+        self,
+        rhs: Self,
+        int: impl FnOnce(i64, i64) -> Option<i64>,
+        float: impl FnOnce(f64, f64) -> f64,
+    ) -> Self {
+        if let (Value::Int(lhs), Value::Int(rhs)) = (self, rhs) {
+            if let Some(value) = int(lhs, rhs) {
+                return Value::Int(value);
+            }
+        }
+
+        Value::Float(float(self.to_f64(), rhs.to_f64()))
+    }
+}
+
+impl Add for Value {
+    type Output = Self;
+
+    fn add(self, rhs: Self) -> Self {
+        self.apply(rhs, i64::checked_add, |lhs, rhs| lhs + rhs)
+    }
+}
+
+impl Sub for Value {
+    type Output = Self;
+
+    fn sub(self, rhs: Self) -> Self {
+        self.apply(rhs, i64::checked_sub, |lhs, rhs| lhs - rhs)
+    }
+}
+
+impl Mul for Value {
+    type Output = Self;
+
+    fn mul(self, rhs: Self) -> Self {
+        self.apply(rhs, i64::checked_mul, |lhs, rhs| lhs * rhs)
+    }
+}
+
+impl Div for Value {
+    type Output = Self;
+
+    fn div(self, rhs: Self) -> Self {
+        self.apply(
+            rhs,
+            |lhs, rhs| match lhs.checked_rem(rhs) {
+                Some(0) => lhs.checked_div(rhs),
+                _ => None,
+            },
+            |lhs, rhs| lhs / rhs,
+        )
+    }
+}
+
+impl Neg for Value {
+    type Output = Self;
+
+    fn neg(self) -> Self {
+        match self {
+            Value::Int(value) => value
+                .checked_neg()
+                .map_or(Value::Float(-(value as f64)), Value::Int),
+            Value::Float(value) => Value::Float(-value),
+        }
+    }
+}
+
+impl Number for Value {
+    fn parse(text: &str) -> Result<Self> {
+        match text.parse::<i64>() {
+            Ok(value) => Ok(Value::Int(value)),
+            Err(_) => f64::parse(text).map(Value::Float),
+        }
+    }
+
+    fn pow(self, rhs: Self) -> Self {
+        // 指数が負なら整数にならないので f64 で計算する
+        self.apply(
+            rhs,
+            |lhs, rhs| lhs.checked_pow(u32::try_from(rhs).ok()?),
+            f64::powf,
+        )
+    }
+
+    fn from_value(value: Value) -> Self {
+        value
+    }
+
+    fn to_value(self) -> Value {
+        self
+    }
+}
+
+impl fmt::Display for Value {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Value::Int(value) => write!(f, "{}", value),
+            Value::Float(value) => write!(f, "{}", value),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Number, Value};
+
+    #[test]
+    fn test_value() {
+        use Value::{Float, Int};
+
+        assert_eq!(Int(2) + Int(3), Int(5));
+        assert_eq!(Int(i64::MAX) + Int(1), Float(i64::MAX as f64 + 1.0));
+        assert_eq!(Int(i64::MIN) - Int(1), Float(i64::MIN as f64 - 1.0));
+        assert_eq!(-Int(i64::MIN), Float(-(i64::MIN as f64)));
+        assert_eq!(Int(6) / Int(3), Int(2));
+        assert_eq!(Int(1) / Int(2), Float(0.5));
+        assert_eq!(Int(1) / Int(0), Float(f64::INFINITY));
+        assert_eq!(Int(i64::MIN) / Int(-1), Float(-(i64::MIN as f64)));
+        assert_eq!(Int(3).pow(Int(39)), Int(4052555153018976267));
+        assert_eq!(Int(2).pow(Int(64)), Float(2f64.powf(64.0)));
+        assert_eq!(Int(2).pow(Int(-1)), Float(0.5));
+        assert_eq!(Float(1.5) * Int(2), Float(3.0));
+
+        assert_eq!(Value::parse("99999999999999999999").unwrap(), Float(1e20));
+        assert_eq!(f64::from_value(Int(1 << 60)), 2f64.powf(60.0));
+        assert_eq!(2.0.to_value(), Float(2.0));
+    }
+}
@@ -0,0 +1,261 @@
+//! 1 行に収まった巨大な `a+b+c+...` を、トップレベルの二項 `+`/`-` で分割して並列にパース・評価する
+//!
+//! `+`/`-` は `prec.left(1, ...)` で最も優先順位が低い左結合なので、トップレベルの二項 `+`/`-` で
+//! 区切った各項は独立に評価できる。ただし浮動小数点の加減算は結合法則を満たさないため、
+//! 項の値を畳み込むところだけは逐次評価と同じ順番で左から行う。
+
+use anyhow::{Context, Result};
+use tree_sitter::Node;
+use tree_sitter_practice::{run_many, with_parser};
+
+use crate::{
+    eval_expr, eval_with,
+    limits::{Budget, Cancelled},
+    number::Number,
+    statement, PracticeContext,
+};
+
+/// これより短い入力は分割しても割に合わないので逐次評価する
+const MIN_PARALLEL_LEN: usize = 1 << 16;
+
+/// 入力が長ければ `threads` 個のチャンクに分けて並列に評価する。結果は `eval_with` とビット単位で一致する
+///
+/// 項は左から逐次評価と同じ順番で畳み込むので、`Value` の `f64` への昇格も同じところで起きる。
+/// `budget` はすべてのチャンクで共有する。パースのタイムアウトはチャンクごとに効く。
+/// 並列度はプールのワーカー数 (コア数) で頭打ちになる。
+pub fn eval_parallel<N: Number>(
+    source: &str,
+    ctx: &mut PracticeContext,
+    threads: usize,
+    budget: &Budget,
+) -> Result<N> {
+    if source.len() < MIN_PARALLEL_LEN {
+        return with_parser(|parser| eval_with(parser, source, ctx, budget));
+    }
+
+    eval_split(source, ctx, threads, budget)
+}
+
+fn eval_split<N: Number>(
+    source: &str,
+    ctx: &mut PracticeContext,
+    threads: usize,
+    budget: &Budget,
+) -> Result<N> {
+    let bounds = split_points(source, threads);
+    if bounds.is_empty() {
+        return with_parser(|parser| eval_with(parser, source, ctx, budget));
+    }
+
+    // チャンクの境界にある `+`/`-` のノードは、どのチャンクの木にも現れないのでここで数える
+    for _ in &bounds {
+        budget.step()?;
+    }
+
+    // (チャンクの前にある演算子, チャンク)
+    let mut chunks = vec![];
+    let mut start = 0;
+    let mut op = "+";
+    for &p in &bounds {
+        chunks.push((op, &source[start..p]));
+        op = &source[p..p + 1];
+        start = p + 1;
+    }
+    chunks.push((op, &source[start..]));
+
+    // チャンクはプロセス全体で共有するパーサーのプールで評価する。
+    // 呼び出しごとにスレッドを作らず、各ワーカーがキャッシュしたパーサーを使い回す
+    let ctx = &*ctx;
+    let tasks = chunks
+        .iter()
+        .map(|&(_, chunk)| {
+            move || {
+                let terms = eval_terms(chunk, ctx, budget);
+                // 1 つのチャンクが失敗したら、残りのチャンクは打ち切る。
+                // まだ始まっていないチャンクも、最初のパースかステップで打ち切られる
+                if terms.is_err() {
+                    budget.cancel();
+                }
+                terms
+            }
+        })
+        .collect();
+    let mut results = run_many(tasks);
+
+    // 打ち切られたチャンクではなく、実際に失敗したチャンクのエラーを返す
+    let failed = results
+        .iter()
+        .position(|terms| matches!(terms, Err(e) if !e.is::<Cancelled>()));
+    if let Some(i) = failed {
+        if let Err(e) = results.swap_remove(i) {
+            return Err(e);
+        }
+    }
+
+    let mut acc = None;
+    for ((chunk_op, _), terms) in chunks.iter().zip(results) {
+        for (i, (op, value)) in terms?.into_iter().enumerate() {
+            let op = if i == 0 { *chunk_op } else { op };
+            acc = Some(match (acc, op) {
+                (None, _) => value,
+                (Some(acc), "+") => acc + value,
+                (Some(acc), "-") => acc - value,
+                _ => unreachable!(),
+            });
+        }
+    }
+
+    acc.context("Cannot parse")
+}
+
+/// 入力を `threads` 個のチャンクに分ける位置を返す。括弧の中と `{...}` コメントの中は除く
+///
+/// 各境界は、おおよそ等分になる位置の直後にあるトップレベルの二項 `+`/`-` にする。
+/// 入力は巨大になりうるので、分割点をすべて集めずに境界だけを記録する。
+/// 代入文や括弧の対応が取れていない入力は分割せず、空を返す。
+fn split_points(source: &str, threads: usize) -> Vec<usize> {
+    let bytes = source.as_bytes();
+    let mut bounds = vec![];
+    // 次の境界を探し始める位置は `source.len() * k / threads`
+    let mut k = 1;
+    let mut depth = 0usize;
+    // 直前の字句が被演算子の末尾なら、次の `+`/`-` は単項ではなく二項
+    let mut after_operand = false;
+
+    let mut i = 0;
+    while i < bytes.len() {
+        match bytes[i] {
+            b'{' => match bytes[i + 1..].iter().position(|&b| b == b'}') {
+                Some(p) => i += p + 1,
+                None => return vec![],
+            },
+            b'(' => {
+                depth += 1;
+                after_operand = false;
+            }
+            b')' => {
+                if depth == 0 {
+                    return vec![];
+                }
+                depth -= 1;
+                after_operand = true;
+            }
+            b'+' | b'-' => {
+                if depth == 0 && after_operand && k < threads && i >= bytes.len() * k / threads {
+                    bounds.push(i);
+                    while k < threads && i >= bytes.len() * k / threads {
+                        k += 1;
+                    }
+                }
+                after_operand = false;
+            }
+            b'=' => return vec![],
+            b'\\' => {}
+            b if b.is_ascii_whitespace() => {}
+            b if b.is_ascii_alphanumeric() || b == b'_' => after_operand = true,
+            _ => after_operand = false,
+        }
+        i += 1;
+    }
+
+    if depth != 0 {
+        return vec![];
+    }
+
+    bounds
+}
+
+/// チャンクをパースし、左結合の `+`/`-` の鎖を項に展開して左から順に評価する
+///
+/// 先頭の項の演算子は意味を持たない。
+fn eval_terms<N: Number>(
+    chunk: &str,
+    ctx: &PracticeContext,
+    budget: &Budget,
+) -> Result<Vec<(&'static str, N)>> {
+    let tree = with_parser(|parser| budget.parse(parser, chunk))?;
+    let root_node = tree.root_node();
+
+    let mut node = statement(root_node)?;
+
+    let mut terms = vec![];
+    while is_additive(node) {
+        // 逐次評価と同じく、鎖の `+`/`-` のノードも 1 ステップと数える
+        budget.step()?;
+        let op = node.child_by_field_name("op").unwrap();
+        let rhs = node.child_by_field_name("rhs").unwrap();
+        terms.push((op.kind(), rhs));
+        node = node.child_by_field_name("lhs").unwrap();
+    }
+    terms.push(("+", node));
+
+    terms
+        .into_iter()
+        .rev()
+        .map(|(op, term)| Ok((op, eval_expr::<N>(term, chunk, ctx, budget)?)))
+        .collect()
+}
+
+fn is_additive(node: Node) -> bool {
+    node.kind() == "binary_expression"
+        && matches!(
+            node.child_by_field_name("op").map(|op| op.kind()),
+            Some("+" | "-")
+        )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{eval_split, split_points};
+    use crate::{
+        eval, eval_exact,
+        limits::{Budget, Limits},
+        number::Value,
+        PracticeContext,
+    };
+
+    #[test]
+    fn test_split_points() {
+        assert_eq!(split_points("1+2-3", 5), vec![1, 3]);
+        assert_eq!(split_points("1+2-3", 2), vec![3]);
+        assert_eq!(split_points("1+2-3", 1), vec![]);
+        assert_eq!(split_points("1+2+3+4+5", 3), vec![3, 7]);
+        assert_eq!(split_points("-1+-2", 5), vec![2]);
+        assert_eq!(split_points("(1+2)*3-4", 9), vec![7]);
+        assert_eq!(split_points("2**-1{a+b}+x", 12), vec![10]);
+        assert_eq!(split_points("x=1+2", 5), vec![]);
+        assert_eq!(split_points("((1+2", 5), vec![]);
+        assert_eq!(split_points("1+{2+3", 6), vec![]);
+    }
+
+    #[test]
+    fn test_eval_split() {
+        let mut ctx = PracticeContext::default();
+        eval("x=3", &mut ctx).unwrap();
+
+        let source = (1..1000)
+            .map(|i| format!("{}/7*x{{c}}-(-{}+1)", i, i % 13))
+            .collect::<Vec<_>>()
+            .join("+");
+
+        let expected = eval(&source, &mut ctx).unwrap();
+        for threads in [2, 3, 8] {
+            let actual: f64 =
+                eval_split(&source, &mut ctx, threads, &Budget::new(&Limits::default())).unwrap();
+            assert_eq!(actual.to_bits(), expected.to_bits());
+        }
+
+        // 整数の和は途中で i64 をあふれると、逐次評価と同じところから f64 になる
+        let source = (0..1000)
+            .map(|i| if i % 3 == 0 { "2**62{c}" } else { "-2**61+x" })
+            .collect::<Vec<_>>()
+            .join("+");
+        let expected = eval_exact(&source, &mut ctx).unwrap();
+        for threads in [2, 3, 8] {
+            let actual =
+                eval_split::<Value>(&source, &mut ctx, threads, &Budget::new(&Limits::default()))
+                    .unwrap();
+            assert_eq!(actual, expected);
+        }
+    }
+}
@@ -0,0 +1,522 @@
+//! スクリプトを行ごとの命令列にコンパイルし、ディスクにキャッシュする
+//!
+//! キャッシュはスクリプトの内容のハッシュと文法のハッシュ (`grammar_hash`) をキーにする。
+//! 64 ビットのハッシュは衝突しうるので、キャッシュにはスクリプトそのものも入れておき、読み込むときに比べる。
+//! 衝突した別のスクリプトのキャッシュは使わずにコンパイルし直して上書きする。
+//! 同じスクリプトを次に実行するときはキャッシュをマップして命令列を直接実行するので、パースを丸ごと省ける。
+//! 文法のハッシュは生成したパーサー (`src/parser.c`) 全体を含むので、優先順位や結合性だけを変えて生成し直しても
+//! 古いキャッシュは使われなくなり、次に書き込むときに消える。
+//!
+//! ファイルの形式 (数値はすべてリトルエンディアン):
+//!
+//! ```text
+//! magic        "PCSC"
+//! version      u32
+//! line_count   u32
+//! code_len     u32
+//! string_count u32
+//! source_len   u32
+//! grammar      u64                       文法のハッシュ
+//! content      u64                       スクリプトの内容の FNV-1a
+//! checksum     u64                       以降すべてのバイトの FNV-1a
+//! source       [u8; source_len]          コンパイルしたスクリプト
+//! line_ends    [u32; line_count]         各行の命令列が code のどこで終わるか
+//! code         [u8; code_len]            命令列 (1 バイトの命令と、必要なら u32 の引数)
+//! offsets      [u32; string_count + 1]   strings 内での各文字列の開始位置
+//! strings      [u8]                      変数名、数値リテラル、エラーメッセージ
+//! ```
+
+use std::{
+    collections::HashMap,
+    fs::{self, File},
+    path::Path,
+};
+
+use anyhow::{bail, ensure, Context, Result};
+use tree_sitter::{Node, Parser};
+
+use crate::{
+    limits::{Budget, Limits, SyntaxError},
+    mmap::{fnv1a, read_u32, read_u64, Mmap},
+    number::Number,
+    statement, walk_expr, Op, PracticeContext,
+};
+
+const MAGIC: &[u8; 4] = b"PCSC";
+const VERSION: u32 = 2;
+const HEADER_LEN: usize = 48;
+
+// 引数を取る命令
+const NUMBER: u8 = 0;
+const LOAD: u8 = 1;
+const STORE: u8 = 2;
+const ERROR: u8 = 3;
+// 引数を取らない命令
+const NEG: u8 = 4;
+const ADD: u8 = 5;
+const SUB: u8 = 6;
+const MUL: u8 = 7;
+const DIV: u8 = 8;
+const POW: u8 = 9;
+/// 値を変えずに 1 ステップだけ消費する (括弧と単項の `+`)
+const STEP: u8 = 10;
+
+/// `dir` にあるキャッシュからスクリプトを読み込む。なければコンパイルしてキャッシュに書き込む
+pub fn load_or_compile(dir: &Path, source: &str, limits: &Limits) -> Result<Program> {
+    let grammar = tree_sitter_practice::grammar_hash();
+    let content = fnv1a(source.as_bytes());
+    let name = format!("{:016x}-{:016x}.pcsc", content, grammar);
+    let path = dir.join(&name);
+
+    if let Ok(file) = File::open(&path) {
+        let map = Mmap::map(&file).with_context(|| format!("Cannot map {}", path.display()))?;
+        // 壊れたキャッシュはコンパイルし直して上書きする
+        if let Ok(program) = Program::new(Bytes::Mapped(map), grammar, content, source) {
+            return Ok(program);
+        }
+    }
+
+    let (bytes, cacheable) = compile(source, limits, grammar, content)?;
+
+    // タイムアウトした行を含む場合は、次に実行したときに結果が変わりうるのでキャッシュしない
+    if cacheable {
+        fs::create_dir_all(dir).with_context(|| format!("Cannot create {}", dir.display()))?;
+
+        // 同じスクリプトを別の文法でコンパイルしたキャッシュは、もう使われないので消す
+        let prefix = format!("{:016x}-", content);
+        for entry in fs::read_dir(dir)?.flatten() {
+            let file_name = entry.file_name();
+            let file_name = file_name.to_string_lossy();
+            if file_name.starts_with(&prefix) && file_name.ends_with(".pcsc") && file_name != name {
+                let _ = fs::remove_file(entry.path());
+            }
+        }
+
+        let tmp = path.with_extension("tmp");
+        fs::write(&tmp, &bytes).with_context(|| format!("Cannot write {}", tmp.display()))?;
+        fs::rename(&tmp, &path).with_context(|| format!("Cannot write {}", path.display()))?;
+    }
+
+    Program::new(Bytes::Owned(bytes), grammar, content, source)
+}
+
+/// `source` を 1 行ずつコンパイルする。2 つめの値はキャッシュしてよいかどうか
+fn compile(source: &str, limits: &Limits, grammar: u64, content: u64) -> Result<(Vec<u8>, bool)> {
+    let mut compiler = Compiler::default();
+    tree_sitter_practice::with_parser(|parser| {
+        for line in source.lines() {
+            compiler.line(parser, line, limits);
+        }
+    });
+
+    let source_len = u32::try_from(source.len()).context("Script is too large")?;
+    let line_count = u32::try_from(compiler.line_ends.len()).context("Too many lines")?;
+    let code_len = u32::try_from(compiler.code.len()).context("Script is too large")?;
+    let string_count = u32::try_from(compiler.strings.len()).context("Too many strings")?;
+
+    let mut body = source.as_bytes().to_vec();
+    for end in &compiler.line_ends {
+        body.extend_from_slice(&end.to_le_bytes());
+    }
+    body.extend_from_slice(&compiler.code);
+    let mut offset = 0u32;
+    body.extend_from_slice(&offset.to_le_bytes());
+    for string in &compiler.strings {
+        offset = u32::try_from(string.len())
+            .ok()
+            .and_then(|len| offset.checked_add(len))
+            .context("Script is too large")?;
+        body.extend_from_slice(&offset.to_le_bytes());
+    }
+    for string in &compiler.strings {
+        body.extend_from_slice(string.as_bytes());
+    }
+
+    let mut bytes = Vec::with_capacity(HEADER_LEN + body.len());
+    bytes.extend_from_slice(MAGIC);
+    bytes.extend_from_slice(&VERSION.to_le_bytes());
+    bytes.extend_from_slice(&line_count.to_le_bytes());
+    bytes.extend_from_slice(&code_len.to_le_bytes());
+    bytes.extend_from_slice(&string_count.to_le_bytes());
+    bytes.extend_from_slice(&source_len.to_le_bytes());
+    bytes.extend_from_slice(&grammar.to_le_bytes());
+    bytes.extend_from_slice(&content.to_le_bytes());
+    bytes.extend_from_slice(&fnv1a(&body).to_le_bytes());
+    bytes.extend_from_slice(&body);
+
+    Ok((bytes, compiler.cacheable))
+}
+
+struct Compiler {
+    code: Vec<u8>,
+    line_ends: Vec<u32>,
+    strings: Vec<String>,
+    string_ids: HashMap<String, u32>,
+    cacheable: bool,
+}
+
+impl Default for Compiler {
+    fn default() -> Self {
+        Compiler {
+            code: vec![],
+            line_ends: vec![],
+            strings: vec![],
+            string_ids: HashMap::new(),
+            cacheable: true,
+        }
+    }
+}
+
+impl Compiler {
+    fn line(&mut self, parser: &mut Parser, line: &str, limits: &Limits) {
+        match Budget::new(limits).parse(parser, line) {
+            Ok(tree) => {
+                let start = self.code.len();
+                let result =
+                    statement(tree.root_node()).and_then(|node| self.statement(node, line));
+                // 途中まで出した命令は捨て、評価するときに同じエラーを返す
+                if let Err(e) = result {
+                    self.code.truncate(start);
+                    self.emit(ERROR, &e.to_string());
+                }
+            }
+            // 評価するときにパースと同じエラーを返す
+            Err(e) => {
+                if !e.is::<SyntaxError>() {
+                    self.cacheable = false;
+                }
+                self.emit(ERROR, &e.to_string());
+            }
+        }
+
+        self.line_ends.push(self.code.len() as u32);
+    }
+
+    fn statement(&mut self, node: Node, source: &str) -> Result<()> {
+        if node.kind() == "assignment" {
+            let lhs = node.child_by_field_name("lhs").unwrap();
+            let rhs = node.child_by_field_name("rhs").unwrap();
+            self.expr(rhs, source)?;
+            self.emit(STORE, lhs.utf8_text(source.as_bytes()).unwrap());
+        } else {
+            self.expr(node, source)?;
+        }
+
+        Ok(())
+    }
+
+    /// `eval_expr` と同じ順番で部分式を評価する命令を出す
+    fn expr(&mut self, node: Node, source: &str) -> Result<()> {
+        walk_expr(node, source, |op| {
+            match op {
+                Op::Number(text) => self.emit(NUMBER, text),
+                Op::Load(name) => self.emit(LOAD, name),
+                Op::Neg => self.code.push(NEG),
+                Op::Step => self.code.push(STEP),
+                Op::Binary(op) => self.code.push(match op {
+                    "+" => ADD,
+                    "-" => SUB,
+                    "*" => MUL,
+                    "/" => DIV,
+                    "**" => POW,
+                    _ => unimplemented!(),
+                }),
+            }
+            Ok(())
+        })
+    }
+
+    fn emit(&mut self, op: u8, string: &str) {
+        let id = match self.string_ids.get(string) {
+            Some(&id) => id,
+            None => {
+                let id = self.strings.len() as u32;
+                self.strings.push(string.to_owned());
+                self.string_ids.insert(string.to_owned(), id);
+                id
+            }
+        };
+
+        self.code.push(op);
+        self.code.extend_from_slice(&id.to_le_bytes());
+    }
+}
+
+enum Bytes {
+    Mapped(Mmap),
+    Owned(Vec<u8>),
+}
+
+impl Bytes {
+    fn as_slice(&self) -> &[u8] {
+        match self {
+            Bytes::Mapped(map) => map.as_slice(),
+            Bytes::Owned(bytes) => bytes,
+        }
+    }
+}
+
+/// コンパイル済みのスクリプト。命令列はファイルをマップしたまま読む
+pub struct Program {
+    bytes: Bytes,
+    line_ends_start: usize,
+    line_count: usize,
+    code_start: usize,
+    code_len: usize,
+    offsets_start: usize,
+    strings_start: usize,
+    string_count: usize,
+}
+
+impl Program {
+    fn new(bytes: Bytes, grammar: u64, content: u64, source: &str) -> Result<Program> {
+        let data = bytes.as_slice();
+        ensure!(
+            data.len() >= HEADER_LEN && &data[0..4] == MAGIC,
+            "Not a script cache"
+        );
+        ensure!(
+            read_u32(data, 4) == VERSION,
+            "Unsupported script cache version"
+        );
+        ensure!(
+            read_u64(data, 24) == grammar && read_u64(data, 32) == content,
+            "Script cache is for another grammar or script"
+        );
+        ensure!(
+            fnv1a(&data[HEADER_LEN..]) == read_u64(data, 40),
+            "Script cache checksum mismatch"
+        );
+
+        let source_len = read_u32(data, 20) as usize;
+        ensure!(
+            data.get(HEADER_LEN..HEADER_LEN + source_len) == Some(source.as_bytes()),
+            "Script cache is for another script"
+        );
+
+        let line_count = read_u32(data, 8) as usize;
+        let code_len = read_u32(data, 12) as usize;
+        let string_count = read_u32(data, 16) as usize;
+        let line_ends_start = HEADER_LEN + source_len;
+        let code_start = line_ends_start + line_count * 4;
+        let offsets_start = code_start + code_len;
+        let strings_start = offsets_start + (string_count + 1) * 4;
+        ensure!(strings_start <= data.len(), "Truncated script cache");
+
+        let program = Program {
+            bytes,
+            line_ends_start,
+            line_count,
+            code_start,
+            code_len,
+            offsets_start,
+            strings_start,
+            string_count,
+        };
+
+        let data = program.bytes.as_slice();
+        let mut prev = 0;
+        for line in 0..line_count {
+            let end = read_u32(data, line_ends_start + line * 4) as usize;
+            ensure!(prev <= end && end <= code_len, "Corrupted script cache");
+            prev = end;
+        }
+        let mut prev = 0;
+        for i in 0..=string_count {
+            let offset = read_u32(data, offsets_start + i * 4) as usize;
+            ensure!(
+                prev <= offset && strings_start + offset <= data.len(),
+                "Corrupted script cache"
+            );
+            prev = offset;
+        }
+        std::str::from_utf8(&data[strings_start..strings_start + prev])
+            .context("Corrupted script cache")?;
+
+        Ok(program)
+    }
+
+    pub fn line_count(&self) -> usize {
+        self.line_count
+    }
+
+    fn string(&self, id: u32) -> Result<&str> {
+        let id = id as usize;
+        ensure!(id < self.string_count, "Corrupted script cache");
+
+        let data = self.bytes.as_slice();
+        let start = self.strings_start + read_u32(data, self.offsets_start + id * 4) as usize;
+        let end = self.strings_start + read_u32(data, self.offsets_start + id * 4 + 4) as usize;
+        Ok(std::str::from_utf8(&data[start..end]).unwrap())
+    }
+
+    /// `line` 行目 (0 始まり) を評価する。結果とエラーは `eval_with` と同じになる
+    ///
+    /// 命令 1 つを 1 ステップと数える。括弧と単項の `+` には `STEP` を出してあるので、ステップ数も `eval_with` と同じになる
+    pub fn run<N: Number>(
+        &self,
+        line: usize,
+        ctx: &mut PracticeContext,
+        budget: &Budget,
+    ) -> Result<N> {
+        ensure!(line < self.line_count, "No line {} in script", line + 1);
+
+        let data = self.bytes.as_slice();
+        let end = read_u32(data, self.line_ends_start + line * 4) as usize;
+        let start = match line {
+            0 => 0,
+            _ => read_u32(data, self.line_ends_start + (line - 1) * 4) as usize,
+        };
+        let code = &data[self.code_start..self.code_start + self.code_len][start..end];
+
+        let mut stack: Vec<N> = vec![];
+        let mut pc = 0;
+        while pc < code.len() {
+            let op = code[pc];
+            pc += 1;
+
+            if op <= ERROR {
+                ensure!(pc + 4 <= code.len(), "Corrupted script cache");
+                let string = self.string(read_u32(code, pc))?;
+                pc += 4;
+
+                match op {
+                    NUMBER => {
+                        budget.step()?;
+                        stack.push(N::parse(string)?);
+                    }
+                    LOAD => {
+                        budget.step()?;
+                        let value = ctx
+                            .get(string)
+                            .map(N::from_value)
+                            .with_context(|| format!("undefined variable: {}", string))?;
+                        stack.push(value);
+                    }
+                    STORE => {
+                        let value = *stack.last().context("Corrupted script cache")?;
+                        ctx.variables.insert(string, value.to_value());
+                    }
+                    _ => bail!("{}", string),
+                }
+                continue;
+            }
+
+            budget.step()?;
+            if op == STEP {
+                continue;
+            }
+            let rhs = stack.pop().context("Corrupted script cache")?;
+            if op == NEG {
+                stack.push(-rhs);
+                continue;
+            }
+
+            let lhs = stack.pop().context("Corrupted script cache")?;
+            stack.push(match op {
+                ADD => lhs + rhs,
+                SUB => lhs - rhs,
+                MUL => lhs * rhs,
+                DIV => lhs / rhs,
+                POW => lhs.pow(rhs),
+                _ => bail!("Corrupted script cache"),
+            });
+        }
+
+        ensure!(stack.len() == 1, "Corrupted script cache");
+        Ok(stack[0])
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{env, fs, process};
+
+    use tree_sitter_practice::with_parser;
+
+    use super::load_or_compile;
+    use crate::{
+        eval, eval_with,
+        limits::{Budget, Limits},
+        PracticeContext,
+    };
+
+    #[test]
+    fn test_script_cache() {
+        let dir = env::temp_dir().join(format!("practice-script-{}", process::id()));
+        let source = "x=2**3+1\nx{コメント}*-x\n2+\ny\n(x-1)/4\n";
+        let limits = Limits::default();
+
+        let mut expected = PracticeContext::default();
+        let expected = source
+            .lines()
+            .map(|line| eval(line, &mut expected).map_err(|e| e.to_string()))
+            .collect::<Vec<_>>();
+
+        // 1 回目はコンパイルしてキャッシュに書き込み、2 回目はキャッシュから読み込む
+        for _ in 0..2 {
+            let program = load_or_compile(&dir, source, &limits).unwrap();
+            assert_eq!(program.line_count(), 5);
+
+            let mut ctx = PracticeContext::default();
+            let actual = (0..program.line_count())
+                .map(|line| {
+                    program
+                        .run::<f64>(line, &mut ctx, &Budget::new(&limits))
+                        .map_err(|e| e.to_string())
+                })
+                .collect::<Vec<_>>();
+            assert_eq!(actual, expected);
+        }
+        assert_eq!(fs::read_dir(&dir).unwrap().count(), 1);
+
+        // ハッシュが衝突した別のスクリプトのキャッシュは使わない
+        let cached = fs::read_dir(&dir).unwrap().next().unwrap().unwrap().path();
+        load_or_compile(&dir, "1+1\n", &limits).unwrap();
+        let other_cached = fs::read_dir(&dir)
+            .unwrap()
+            .map(|entry| entry.unwrap().path())
+            .find(|path| *path != cached)
+            .unwrap();
+        fs::rename(&other_cached, &cached).unwrap();
+        let program = load_or_compile(&dir, source, &limits).unwrap();
+        assert_eq!(program.line_count(), 5);
+        assert_eq!(
+            program
+                .run::<f64>(4, &mut PracticeContext::default(), &Budget::new(&limits))
+                .map_err(|e| e.to_string()),
+            Err("undefined variable: x".to_owned())
+        );
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_steps() {
+        let dir = env::temp_dir().join(format!("practice-steps-{}", process::id()));
+        let source = "x=(+(1))\n-(+x)*((2))\n";
+        let program = load_or_compile(&dir, source, &Limits::default()).unwrap();
+
+        // 括弧と単項の `+` も数えるので、どの上限でも `eval_with` と同じところで打ち切られる
+        for max_steps in 0..10 {
+            let limits = Limits {
+                max_steps: Some(max_steps),
+                ..Limits::default()
+            };
+            let mut expected_ctx = PracticeContext::default();
+            let mut actual_ctx = PracticeContext::default();
+            for (line, text) in source.lines().enumerate() {
+                let expected = with_parser(|parser| {
+                    eval_with::<f64>(parser, text, &mut expected_ctx, &Budget::new(&limits))
+                })
+                .map_err(|e| e.to_string());
+                let actual = program
+                    .run::<f64>(line, &mut actual_ctx, &Budget::new(&limits))
+                    .map_err(|e| e.to_string());
+                assert_eq!(actual, expected, "max_steps {} line {}", max_steps, line);
+            }
+        }
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
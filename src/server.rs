@@ -0,0 +1,348 @@
+//! ローカルの評価サーバー
+//!
+//! 1 行が 1 リクエストで、`<session-id> <source>` を送ると `ok <value>` か `err <message>` が 1 行で返る。
+//! 応答はリクエストの順に返るので、クライアントは応答を待たずに続けて送ってよい (パイプライン)。
+//! 変数はセッション ID ごとに保持され、接続をまたいでも引き継がれる。
+//! `<session-id> !close` を送るとセッションを破棄する (`!` は式に現れないので、式と紛れない)。
+
+use std::{
+    collections::HashMap,
+    io::{self, BufRead, BufReader, BufWriter, Read, Write},
+    mem,
+    net::{TcpListener, TcpStream},
+    panic::{self, AssertUnwindSafe},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        mpsc, Arc, Mutex,
+    },
+    thread,
+};
+
+#[cfg(unix)]
+use std::os::unix::net::{UnixListener, UnixStream};
+
+use anyhow::Result;
+use tree_sitter::Parser;
+
+use crate::{
+    concurrent::{eval_shared, Reader, SharedContext},
+    limits::{Budget, Limits},
+    new_parser, PracticeContext,
+};
+
+/// セッションの変数は `SharedContext` に置くので、同じセッションを読むだけのリクエストは互いに待たない
+#[derive(Default)]
+struct Sessions {
+    contexts: Mutex<HashMap<String, SharedContext>>,
+    /// 破棄したセッションの数。ワーカーはこれが変わったときだけ、破棄されたセッションの読み手を捨てる
+    closed: AtomicU64,
+}
+
+impl Sessions {
+    fn get(&self, id: &str) -> SharedContext {
+        self.contexts
+            .lock()
+            .unwrap()
+            .entry(id.to_owned())
+            .or_insert_with(|| SharedContext::new(PracticeContext::default()))
+            .clone()
+    }
+
+    fn close(&self, id: &str) {
+        if self.contexts.lock().unwrap().remove(id).is_some() {
+            self.closed.fetch_add(1, Ordering::SeqCst);
+        }
+    }
+}
+
+/// ワーカーごとの状態。パーサーと、セッションごとの読み手を持つ
+struct Worker {
+    parser: Parser,
+    readers: HashMap<String, Reader>,
+    /// 最後に読み手を整理したときの `Sessions::closed`
+    closed: u64,
+}
+
+impl Worker {
+    /// 破棄されたセッションの読み手を捨てる。同じ ID で作り直されたセッションの読み手も捨てる
+    fn prune(&mut self, sessions: &Sessions) {
+        let closed = sessions.closed.load(Ordering::SeqCst);
+        if closed == self.closed {
+            return;
+        }
+        self.closed = closed;
+
+        let contexts = sessions.contexts.lock().unwrap();
+        self.readers.retain(|id, reader| {
+            contexts
+                .get(id)
+                .map_or(false, |shared| reader.reads(shared))
+        });
+    }
+}
+
+/// ワーカーに渡す 1 リクエスト。応答と一緒に `line` を返すので、接続側はバッファを使い回せる
+struct Job {
+    line: String,
+    reply: mpsc::Sender<(String, String)>,
+}
+
+enum Connection {
+    Tcp(TcpStream),
+    #[cfg(unix)]
+    Unix(UnixStream),
+}
+
+/// `addr` で待ち受け、`workers` 個のスレッドで接続を処理する。`unix:` で始まる場合は Unix ソケット
+pub fn serve(addr: &str, workers: usize, limits: Limits) -> Result<()> {
+    #[cfg(unix)]
+    if let Some(path) = addr.strip_prefix("unix:") {
+        remove_stale_socket(path);
+        let listener = UnixListener::bind(path)?;
+        eprintln!("listening on {}", addr);
+        return run(
+            listener.incoming().map(|s| s.map(Connection::Unix)),
+            workers,
+            limits,
+        );
+    }
+
+    let listener = TcpListener::bind(addr)?;
+    eprintln!("listening on {}", listener.local_addr()?);
+    serve_tcp(listener, workers, limits)
+}
+
+/// 前に動いていたサーバーが残したソケットファイルを消す。
+/// 待ち受けているサーバーがいるときや、ソケットでないファイルは消さずに `bind` を失敗させる
+#[cfg(unix)]
+fn remove_stale_socket(path: &str) {
+    use std::{fs, os::unix::fs::FileTypeExt};
+
+    let is_socket = fs::symlink_metadata(path).map_or(false, |m| m.file_type().is_socket());
+    if is_socket && UnixStream::connect(path).is_err() {
+        let _ = fs::remove_file(path);
+    }
+}
+
+fn serve_tcp(listener: TcpListener, workers: usize, limits: Limits) -> Result<()> {
+    run(
+        listener.incoming().map(|s| s.map(Connection::Tcp)),
+        workers,
+        limits,
+    )
+}
+
+/// 接続ごとのスレッドがリクエストを 1 行ずつ読み、`workers` 個のワーカーに 1 リクエストずつ渡す。
+/// 接続の数はワーカーの数に縛られないので、つないだまま何も送らない接続があっても他の接続は待たされない。
+/// 同じ接続のリクエストは 1 つずつ順に処理するので、応答も代入も送った順になる。
+fn run(
+    connections: impl Iterator<Item = io::Result<Connection>>,
+    workers: usize,
+    limits: Limits,
+) -> Result<()> {
+    let sessions = Arc::new(Sessions::default());
+    let (sender, receiver) = mpsc::channel::<Job>();
+    let receiver = Arc::new(Mutex::new(receiver));
+
+    for _ in 0..workers.max(1) {
+        let sessions = sessions.clone();
+        let receiver = receiver.clone();
+        let mut worker = Worker {
+            parser: new_parser()?,
+            readers: HashMap::new(),
+            closed: 0,
+        };
+
+        thread::spawn(move || loop {
+            let job = match receiver.lock().unwrap().recv() {
+                Ok(job) => job,
+                Err(_) => break,
+            };
+
+            let response = respond(job.line.trim_end(), &mut worker, &sessions, &limits);
+            let _ = job.reply.send((job.line, response));
+        });
+    }
+
+    for connection in connections {
+        let connection = match connection {
+            Ok(connection) => connection,
+            Err(e) => {
+                eprintln!("accept error: {}", e);
+                continue;
+            }
+        };
+
+        let jobs = sender.clone();
+        thread::spawn(move || {
+            let result = match &connection {
+                Connection::Tcp(stream) => handle_connection(stream, &jobs),
+                #[cfg(unix)]
+                Connection::Unix(stream) => handle_connection(stream, &jobs),
+            };
+            if let Err(e) = result {
+                eprintln!("connection error: {}", e);
+            }
+        });
+    }
+
+    Ok(())
+}
+
+fn handle_connection<S>(stream: &S, jobs: &mpsc::Sender<Job>) -> io::Result<()>
+where
+    for<'a> &'a S: Read + Write,
+{
+    let mut reader = BufReader::new(stream);
+    let mut writer = BufWriter::new(stream);
+    let mut line = String::new();
+    let (reply, replies) = mpsc::channel();
+    let stopped = || io::Error::new(io::ErrorKind::Other, "workers stopped");
+
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 {
+            break;
+        }
+
+        let job = Job {
+            line: mem::take(&mut line),
+            reply: reply.clone(),
+        };
+        jobs.send(job).map_err(|_| stopped())?;
+        let (returned, response) = replies.recv().map_err(|_| stopped())?;
+        line = returned;
+
+        writeln!(writer, "{}", response)?;
+
+        // パイプラインで後続のリクエストが既に届いていれば、応答はまとめて送る
+        if reader.buffer().is_empty() {
+            writer.flush()?;
+        }
+    }
+
+    writer.flush()
+}
+
+fn respond(request: &str, worker: &mut Worker, sessions: &Sessions, limits: &Limits) -> String {
+    let (id, source) = match request.split_once(' ') {
+        Some(request) => request,
+        None => return "err expected `<session-id> <source>`".to_owned(),
+    };
+
+    if source == "!close" {
+        sessions.close(id);
+        worker.readers.remove(id);
+        return "ok closed".to_owned();
+    }
+    worker.prune(sessions);
+
+    // 読み手は初めてのセッションのときだけ作るので、それ以外はロックもメモリ確保もしない
+    if !worker.readers.contains_key(id) {
+        let reader = sessions.get(id).reader();
+        worker.readers.insert(id.to_owned(), reader);
+    }
+    let reader = worker.readers.get_mut(id).unwrap();
+    let parser = &mut worker.parser;
+
+    // 評価中に panic しても、ワーカーとセッションは生かしておく
+    let result = panic::catch_unwind(AssertUnwindSafe(|| {
+        eval_shared::<f64>(parser, source, reader, &Budget::new(limits))
+    }));
+
+    match result {
+        Ok(Ok(value)) => format!("ok {}", value),
+        Ok(Err(e)) => format!("err {}", e).replace('\n', " "),
+        Err(_) => {
+            parser.reset();
+            "err evaluation panicked".to_owned()
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        io::{BufRead, BufReader, Write},
+        net::{TcpListener, TcpStream},
+        thread,
+    };
+
+    use super::serve_tcp;
+    #[cfg(unix)]
+    use super::{remove_stale_socket, UnixListener};
+    use crate::limits::Limits;
+
+    #[test]
+    fn test_pipelined_sessions() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        thread::spawn(move || serve_tcp(listener, 2, Limits::default()));
+
+        let mut stream = TcpStream::connect(addr).unwrap();
+        stream
+            .write_all(b"a x=2\nb x=3\na x*x\nb x*x\nc x\nbroken\nd {c}x=1\nd x\n")
+            .unwrap();
+
+        let mut lines = BufReader::new(stream.try_clone().unwrap()).lines();
+        let mut next = || lines.next().unwrap().unwrap();
+        assert_eq!(next(), "ok 2");
+        assert_eq!(next(), "ok 3");
+        assert_eq!(next(), "ok 4");
+        assert_eq!(next(), "ok 9");
+        assert_eq!(next(), "err undefined variable: x");
+        assert!(next().starts_with("err "));
+        assert_eq!(next(), "ok 1");
+        assert_eq!(next(), "ok 1");
+
+        // セッションは接続をまたいで残る
+        let mut stream = TcpStream::connect(addr).unwrap();
+        stream.write_all(b"a x+1\n").unwrap();
+        let mut lines = BufReader::new(stream).lines();
+        assert_eq!(lines.next().unwrap().unwrap(), "ok 3");
+    }
+
+    #[test]
+    fn test_idle_connections_and_close() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        thread::spawn(move || serve_tcp(listener, 1, Limits::default()));
+
+        // ワーカーより多い接続が何も送らずにつないでいても、他の接続は処理される
+        let _idle = (0..3)
+            .map(|_| TcpStream::connect(addr).unwrap())
+            .collect::<Vec<_>>();
+
+        let mut stream = TcpStream::connect(addr).unwrap();
+        stream
+            .write_all(b"a x=2\na !close\na x\na x=5\na x\n")
+            .unwrap();
+
+        let mut lines = BufReader::new(stream).lines();
+        let mut next = || lines.next().unwrap().unwrap();
+        assert_eq!(next(), "ok 2");
+        assert_eq!(next(), "ok closed");
+        assert_eq!(next(), "err undefined variable: x");
+        assert_eq!(next(), "ok 5");
+        assert_eq!(next(), "ok 5");
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_stale_socket() {
+        let path = std::env::temp_dir().join(format!("practice-{}.sock", std::process::id()));
+        let path = path.to_str().unwrap();
+
+        // 待ち受けているソケットは消さない
+        let listener = UnixListener::bind(path).unwrap();
+        remove_stale_socket(path);
+        assert!(std::path::Path::new(path).exists());
+
+        // 閉じたサーバーが残したソケットは消すので、同じパスで待ち受け直せる
+        drop(listener);
+        remove_stale_socket(path);
+        let listener = UnixListener::bind(path).unwrap();
+        drop(listener);
+        std::fs::remove_file(path).unwrap();
+    }
+}
@@ -0,0 +1,253 @@
+//! `PracticeContext` の変数をバイナリのスナップショットとして保存し、mmap で復元する
+//!
+//! ファイルの形式 (数値はすべてリトルエンディアン):
+//!
+//! ```text
+//! magic    "PCTX"
+//! version  u32
+//! count    u32                  変数の数
+//! reserved u32
+//! checksum u64                  以降すべてのバイトの FNV-1a (64 bit)
+//! values   [u64; count]         名前の昇順。整数は i64、それ以外は f64 のビット列
+//! kinds    [u8; count]          0 なら f64、1 なら i64
+//! offsets  [u32; count + 1]     names 内での各名前の開始位置
+//! names    [u8]                 名前を昇順に連結したもの
+//! ```
+//!
+//! 復元時はヘッダーとファイルの長さだけを確かめ、値はマップしたファイルから二分探索で直接読む。
+//! チェックサムと名前の位置の検査はファイル全体を読むことになるので、`verify` を指定したときだけ行う。
+//! 検査しなかったファイルが壊れていても、誤った値を読むことはあっても範囲外を読むことはない。
+//! 復元後の代入は `PracticeContext` 側の `HashMap` に書かれ、スナップショットは変更しない。
+
+use std::{
+    fs::{self, File},
+    path::Path,
+};
+
+use anyhow::{ensure, Context, Result};
+
+use crate::{
+    mmap::{fnv1a, read_u32, read_u64, Mmap},
+    number::Value,
+};
+
+const MAGIC: &[u8; 4] = b"PCTX";
+const VERSION: u32 = 2;
+const FLOAT: u8 = 0;
+const INT: u8 = 1;
+const HEADER_LEN: usize = 24;
+
+pub struct Snapshot {
+    map: Mmap,
+    count: usize,
+}
+
+impl Snapshot {
+    /// `variables` を名前の昇順に並べて `path` に書き出す。書き込みは一時ファイルからの rename で行う
+    pub fn save<'a>(
+        path: &Path,
+        variables: impl IntoIterator<Item = (&'a str, Value)>,
+    ) -> Result<()> {
+        let mut variables = variables.into_iter().collect::<Vec<_>>();
+        variables.sort_by(|a, b| a.0.cmp(b.0));
+        variables.dedup_by(|a, b| a.0 == b.0);
+
+        let count = u32::try_from(variables.len()).context("Too many variables")?;
+
+        let mut body = vec![];
+        for (_, value) in &variables {
+            let bits = match *value {
+                Value::Int(value) => value as u64,
+                Value::Float(value) => value.to_bits(),
+            };
+            body.extend_from_slice(&bits.to_le_bytes());
+        }
+        for (_, value) in &variables {
+            body.push(match value {
+                Value::Int(_) => INT,
+                Value::Float(_) => FLOAT,
+            });
+        }
+        let mut offset = 0u32;
+        body.extend_from_slice(&offset.to_le_bytes());
+        for (name, _) in &variables {
+            offset = u32::try_from(name.len())
+                .ok()
+                .and_then(|len| offset.checked_add(len))
+                .context("Variable names are too long")?;
+            body.extend_from_slice(&offset.to_le_bytes());
+        }
+        for (name, _) in &variables {
+            body.extend_from_slice(name.as_bytes());
+        }
+
+        let mut bytes = Vec::with_capacity(HEADER_LEN + body.len());
+        bytes.extend_from_slice(MAGIC);
+        bytes.extend_from_slice(&VERSION.to_le_bytes());
+        bytes.extend_from_slice(&count.to_le_bytes());
+        bytes.extend_from_slice(&0u32.to_le_bytes());
+        bytes.extend_from_slice(&fnv1a(&body).to_le_bytes());
+        bytes.extend_from_slice(&body);
+
+        let tmp = path.with_extension("tmp");
+        fs::write(&tmp, &bytes).with_context(|| format!("Cannot write {}", tmp.display()))?;
+        fs::rename(&tmp, path).with_context(|| format!("Cannot write {}", path.display()))?;
+
+        Ok(())
+    }
+
+    /// `path` をマップする。`verify` ならチェックサムと名前の位置もすべて検査する
+    pub fn load(path: &Path, verify: bool) -> Result<Snapshot> {
+        let file = File::open(path).with_context(|| format!("Cannot open {}", path.display()))?;
+        let map = Mmap::map(&file).with_context(|| format!("Cannot map {}", path.display()))?;
+        let bytes = map.as_slice();
+
+        ensure!(
+            bytes.len() >= HEADER_LEN && &bytes[0..4] == MAGIC,
+            "Not a context snapshot: {}",
+            path.display()
+        );
+        let version = read_u32(bytes, 4);
+        ensure!(
+            version == VERSION,
+            "Unsupported snapshot version {}",
+            version
+        );
+        let count = read_u32(bytes, 8) as usize;
+        let checksum = read_u64(bytes, 16);
+
+        let len = bytes.len();
+        let snapshot = Snapshot { map, count };
+        let names_start = snapshot.names_start();
+        ensure!(
+            names_start <= len && names_start + snapshot.offset(count) == len,
+            "Truncated snapshot: {}",
+            path.display()
+        );
+
+        if verify {
+            let bytes = snapshot.map.as_slice();
+            ensure!(
+                fnv1a(&bytes[HEADER_LEN..]) == checksum,
+                "Snapshot checksum mismatch: {}",
+                path.display()
+            );
+            let mut prev = 0;
+            for i in 0..=count {
+                let offset = snapshot.offset(i);
+                ensure!(
+                    prev <= offset && names_start + offset <= len,
+                    "Corrupted snapshot: {}",
+                    path.display()
+                );
+                prev = offset;
+            }
+        }
+
+        Ok(snapshot)
+    }
+
+    pub fn get(&self, name: &str) -> Option<Value> {
+        let mut lo = 0;
+        let mut hi = self.count;
+        while lo < hi {
+            let mid = (lo + hi) / 2;
+            match self.name(mid).cmp(name.as_bytes()) {
+                std::cmp::Ordering::Less => lo = mid + 1,
+                std::cmp::Ordering::Greater => hi = mid,
+                std::cmp::Ordering::Equal => return Some(self.value(mid)),
+            }
+        }
+
+        None
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&str, Value)> {
+        (0..self.count)
+            .filter_map(move |i| Some((std::str::from_utf8(self.name(i)).ok()?, self.value(i))))
+    }
+
+    fn value(&self, i: usize) -> Value {
+        let bytes = self.map.as_slice();
+        let bits = read_u64(bytes, HEADER_LEN + i * 8);
+        match bytes[HEADER_LEN + self.count * 8 + i] {
+            INT => Value::Int(bits as i64),
+            _ => Value::Float(f64::from_bits(bits)),
+        }
+    }
+
+    fn offset(&self, i: usize) -> usize {
+        read_u32(self.map.as_slice(), self.offsets_start() + i * 4) as usize
+    }
+
+    fn offsets_start(&self) -> usize {
+        HEADER_LEN + self.count * 9
+    }
+
+    fn names_start(&self) -> usize {
+        self.offsets_start() + (self.count + 1) * 4
+    }
+
+    /// 検査していないファイルでは位置が壊れていることがあるので、範囲外なら空にする
+    fn name(&self, i: usize) -> &[u8] {
+        let start = self.names_start();
+        self.map
+            .as_slice()
+            .get(start + self.offset(i)..start + self.offset(i + 1))
+            .unwrap_or(&[])
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{env, fs, process};
+
+    use super::Snapshot;
+    use crate::number::Value::{Float, Int};
+
+    #[test]
+    fn test_snapshot() {
+        let path = env::temp_dir().join(format!("practice-snapshot-{}.bin", process::id()));
+
+        let variables = [
+            ("y", Float(2.5)),
+            ("x", Float(1.0)),
+            ("long_name", Float(-0.0)),
+            ("z", Float(f64::NAN)),
+            ("i", Int(i64::MIN + 1)),
+        ];
+        Snapshot::save(&path, variables).unwrap();
+
+        let snapshot = Snapshot::load(&path, true).unwrap();
+        assert_eq!(snapshot.get("x"), Some(Float(1.0)));
+        assert_eq!(snapshot.get("y"), Some(Float(2.5)));
+        assert_eq!(snapshot.get("i"), Some(Int(i64::MIN + 1)));
+        assert_eq!(
+            snapshot.get("long_name").unwrap().to_f64().to_bits(),
+            (-0.0f64).to_bits()
+        );
+        assert!(snapshot.get("z").unwrap().to_f64().is_nan());
+        assert_eq!(snapshot.get("w"), None);
+        assert_eq!(
+            snapshot.iter().map(|(name, _)| name).collect::<Vec<_>>(),
+            vec!["i", "long_name", "x", "y", "z"]
+        );
+
+        // 壊れたファイルは検査すれば読み込まない。検査しなくても範囲外は読まない
+        let mut bytes = fs::read(&path).unwrap();
+        *bytes.last_mut().unwrap() ^= 1;
+        // 3 つめの名前の位置の最上位バイト
+        bytes[24 + 5 * 9 + 2 * 4 + 3] = 0xff;
+        fs::write(&path, &bytes).unwrap();
+        assert!(Snapshot::load(&path, true).is_err());
+        let snapshot = Snapshot::load(&path, false).unwrap();
+        assert_eq!(snapshot.iter().count(), 5);
+        let _ = snapshot.get("z");
+
+        // 途中で切れたファイルは検査しなくても読み込まない
+        fs::write(&path, &bytes[..bytes.len() - 1]).unwrap();
+        assert!(Snapshot::load(&path, false).is_err());
+
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,159 @@
+//! 版どうしで構造を共有する変数の表
+//!
+//! `SharedContext` は書き込みのたびに `PracticeContext` を複製して新しい版を作るので、
+//! 変数の表は複製が安く済む永続的なハッシュトライにする。
+//! 名前のハッシュを 4 ビットずつ使って 16 分木をたどり、葉に (ハッシュ, 名前, 値) を並べる。
+//! 複製は根の `Arc` を増やすだけで、書き込みは根から葉までの節だけを `Arc::make_mut` で複製する。
+
+use std::{collections::hash_map::RandomState, hash::BuildHasher, sync::Arc};
+
+use crate::number::Value;
+
+const BITS: u32 = 4;
+const WIDTH: usize = 1 << BITS;
+/// 葉がこれより大きくなったら枝に分ける
+const MAX_LEAF: usize = 8;
+
+#[derive(Clone)]
+enum Node {
+    Leaf(Vec<(u64, Arc<str>, Value)>),
+    Branch([Option<Arc<Node>>; WIDTH]),
+}
+
+#[derive(Clone, Default)]
+pub struct Variables {
+    root: Option<Arc<Node>>,
+    hasher: RandomState,
+}
+
+fn slot(hash: u64, depth: u32) -> usize {
+    ((hash >> (depth * BITS)) as usize) & (WIDTH - 1)
+}
+
+impl Variables {
+    pub fn get(&self, name: &str) -> Option<Value> {
+        let hash = self.hasher.hash_one(name);
+        let mut node = self.root.as_deref()?;
+        let mut depth = 0;
+
+        loop {
+            match node {
+                Node::Leaf(entries) => {
+                    return entries
+                        .iter()
+                        .find(|(h, n, _)| *h == hash && &**n == name)
+                        .map(|&(_, _, value)| value)
+                }
+                Node::Branch(children) => {
+                    node = children[slot(hash, depth)].as_deref()?;
+                    depth += 1;
+                }
+            }
+        }
+    }
+
+    pub fn insert(&mut self, name: &str, value: Value) {
+        let hash = self.hasher.hash_one(name);
+        let root = self
+            .root
+            .get_or_insert_with(|| Arc::new(Node::Leaf(vec![])));
+
+        insert(Arc::make_mut(root), hash, 0, name, value);
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&str, Value)> {
+        let mut stack = self.root.as_deref().into_iter().collect::<Vec<_>>();
+        let mut entries: &[(u64, Arc<str>, Value)] = &[];
+
+        std::iter::from_fn(move || loop {
+            if let Some(((_, name, value), rest)) = entries.split_first() {
+                entries = rest;
+                return Some((&**name, *value));
+            }
+            match stack.pop()? {
+                Node::Leaf(leaf) => entries = leaf,
+                Node::Branch(children) => stack.extend(children.iter().flatten().map(|c| &**c)),
+            }
+        })
+    }
+}
+
+fn insert(node: &mut Node, hash: u64, depth: u32, name: &str, value: Value) {
+    match node {
+        Node::Leaf(entries) => {
+            if let Some(entry) = entries
+                .iter_mut()
+                .find(|(h, n, _)| *h == hash && &**n == name)
+            {
+                entry.2 = value;
+                return;
+            }
+
+            // ハッシュのビットを使い切った葉は、衝突したものをすべて並べて持つ
+            if entries.len() < MAX_LEAF || (depth + 1) * BITS > u64::BITS {
+                entries.push((hash, name.into(), value));
+                return;
+            }
+
+            let mut children: [Option<Arc<Node>>; WIDTH] = Default::default();
+            for entry in entries.drain(..) {
+                let child = children[slot(entry.0, depth)]
+                    .get_or_insert_with(|| Arc::new(Node::Leaf(vec![])));
+                match Arc::get_mut(child).unwrap() {
+                    Node::Leaf(leaf) => leaf.push(entry),
+                    Node::Branch(_) => unreachable!(),
+                }
+            }
+            *node = Node::Branch(children);
+
+            insert(node, hash, depth, name, value)
+        }
+        Node::Branch(children) => {
+            let child =
+                children[slot(hash, depth)].get_or_insert_with(|| Arc::new(Node::Leaf(vec![])));
+            insert(Arc::make_mut(child), hash, depth + 1, name, value)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+
+    use super::Variables;
+    use crate::number::Value;
+
+    #[test]
+    fn test_variables() {
+        let mut variables = Variables::default();
+        let mut expected = HashMap::new();
+        let mut versions = vec![];
+
+        for i in 0..2000 {
+            let name = format!("v{}", i % 1500);
+            variables.insert(&name, Value::Int(i));
+            expected.insert(name, Value::Int(i));
+            if i % 100 == 0 {
+                versions.push((variables.clone(), expected.clone()));
+            }
+        }
+
+        // 古い版は後からの書き込みの影響を受けない
+        versions.push((variables, expected));
+        for (variables, expected) in &versions {
+            for (name, &value) in expected {
+                assert_eq!(variables.get(name), Some(value));
+            }
+            assert_eq!(variables.get("missing"), None);
+
+            let mut actual = variables
+                .iter()
+                .map(|(name, value)| (name.to_owned(), value))
+                .collect::<Vec<_>>();
+            actual.sort_by(|a, b| a.0.cmp(&b.0));
+            let mut expected = expected.clone().into_iter().collect::<Vec<_>>();
+            expected.sort_by(|a, b| a.0.cmp(&b.0));
+            assert_eq!(actual, expected);
+        }
+    }
+}
@@ -3,4 +3,6 @@
 set -eux
 
 # 事前に cargo install http-server で http-server をインストールする必要がある
+# http://127.0.0.1:7878/practice.html を開くと最初のパースまでの時間が表示される。
+# サイトデータを消してから開くとコールドスタート、再読み込みするとウォームスタートになる
 http-server --host 127.0.0.1 --port 7878 .